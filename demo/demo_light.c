@@ -4,49 +4,67 @@
 #include <stdlib.h>
 #include <math.h>
 
-void render_mesh(wg_render_t *render, wg_mesh_t *mesh) {
-  wg_vertex_t *v = assemble_vertex(mesh);
-  uint32_t nv = mesh->nVertex, nt = mesh->nTriangle;
-  uint32_t *tri = mesh->triangle;
-  project_vertexes(render, v, nv);
-  for (int i = 0; i < nt * 3; i += 3) {
-    cull_and_draw_triangle(render, v+tri[i], v+tri[i+1], v+tri[i+2]);
-  }
-  free(v);
-}
-
-void blinn_phong_shader(wg_render_t *render, wg_gbuff_t *gbuff) {  
+void blinn_phong_shader(const wg_render_t *render, wg_gbuff_t *gbuff) {  
   float shininess = 10.0;
-  wg_point_t *lpos = &render->light.position;
-  wg_point_t *vpos = &gbuff->vPos;
-  wg_point_t vl = v4f_sub(render->light.position, gbuff->vPos);
-  normalize_vec4f(&vl);                                                 // light direction
   wg_point_t ve = v4f_sub((wg_point_t){0., 0., 0., 1.}, gbuff->vPos);   
   normalize_vec4f(&ve);                                                 // eye direction
-  wg_point_t vn = v4f_add(vl, ve);
-  normalize_vec4f(&vn);                                                 // half normal
-  float shine = v4f_dot_prod(vn, gbuff->normal);
-  shine = powf(shine, shininess);
-  shine = shine < 0. ? 0. : shine;
+  // The shadow map is rendered from the first light
+  float lit = render->shadow ? sample_shadow(render, &gbuff->vPos) : 1.;
+  // Only the lights of the tile the fragment is in
+  for (uint32_t i = 0; i < gbuff->nLights; i ++) {
+    const wg_light_t *light = render->viewLights + gbuff->lights[i];
+    float atten = gbuff->lights[i] == 0 ? lit : 1.;
+    wg_point_t vl;
+    if (light->type == PARALLEL) {
+      vl = v4f_mul(light->direction, -1.);
+    } else {
+      vl = v4f_sub(light->position, gbuff->vPos);
+      if (light->range > 0.) {
+        float d = sqrtf(v4f_dot_prod(vl, vl)) / light->range;
+        atten *= d < 1. ? (1. - d) * (1. - d) : 0.;
+      }
+    }
+    normalize_vec4f(&vl);                                               // light direction
+    wg_point_t vn = v4f_add(vl, ve);
+    normalize_vec4f(&vn);                                               // half normal
+    float shine = v4f_dot_prod(vn, gbuff->normal);
+    shine = powf(shine, shininess);
+    shine = shine < 0. ? 0. : shine;
+    color_mul_add(&gbuff->specularColorAdder, light->color, shine * atten);
+  }
   
-  color_mul_add(&gbuff->specularColorAdder, render->light.color, shine);
-  color_mul_add(&gbuff->color, gbuff->specularColorAdder, render->material.specular);
-  color_mul_add(&gbuff->color, gbuff->diffuseColor, render->material.diffuse);
+  color_mul_add(&gbuff->color, gbuff->specularColorAdder, gbuff->material->specular);
+  color_mul_add(&gbuff->color, gbuff->diffuseColor, gbuff->material->diffuse * (.5 + .5 * lit));
 }
 
+// The same shading, with the sampler & shader inlined into the loop
+DEFINE_PIPELINE(blinn_phong_pipeline, sampler_bilinear, blinn_phong_shader)
+
 void test_render() {
   init_frag_shader_reg();
   register_frag_shader("BlinnPhongShader", &blinn_phong_shader);
+  wg_pipeline_t pipeline = register_pipeline("BlinnPhongBilinear", &blinn_phong_pipeline);
 
   // Setup scene
   const int W = 256, H = 256;
   wg_render_t *render = get_render();
-  wg_mat44f t_world, t_camera, t_projection;
+  wg_mat44f t_world, t_occluder, t_camera, t_projection;
   wg_point_t eye, center, up;
   wg_mesh_t *plane_mesh = mesh_plane(20., 20.);
+  wg_mesh_t *occluder_mesh = mesh_plane(4., 4.);
+  wg_shadow_map_t *shadow = create_shadow_map(256);
   wg_texture_t *tex_chessboard = get_empty_texture(128, 128);
   set_chessboard_texture(tex_chessboard, 8, 8, 0xffffff, 0xff0000);
-  render->texture = tex_chessboard;
+  // Convert once, the bilinear fetches then stay within a cache line more often
+  set_texture_layout(tex_chessboard, LAYOUT_TILED);
+  wg_texture_t *tex_occluder = get_empty_texture(32, 32);
+  set_chessboard_texture(tex_occluder, 4, 4, 0x40c0ff, 0x204060);
+  // Both materials are shaded in one pass, picked by the material id of each pixel
+  wg_texture_t *textures[2] = {tex_chessboard, tex_occluder};
+  wg_material_t materials[2] = {{0.0, 0.4, 1.0}, {0.0, 0.8, 0.2}};
+  render->textures = textures;
+  render->materials = materials;
+  render->nMaterials = 2;
   uint8_t rgb[W * H * 3], *p = rgb;
 
   eye = (wg_point_t){ {{ -10., -5., 20., 1.}} };
@@ -58,8 +76,8 @@ void test_render() {
   // render->sampleMode = NEAREST;
 
   render->fshaderName = "BlinnPhongShader";
+  render->pipeline = pipeline;
 
-  render->material = (wg_material_t){0.0, 0.4, 1.0};
   wg_light_t light = (wg_light_t){(wg_point_t){5., 5., 5., 1.}, (wg_color_t){.9, .2, .5}};
 
   set_up_render(render, W, H);
@@ -71,9 +89,32 @@ void test_render() {
   render->transform.projection = &t_projection;
   transform_update(&render->transform);
   clear_render(render);
-  set_light(render, light);
 
-  render_mesh(render, plane_mesh);
+  // Depth of the scene seen from the light
+  get_lookat_mat(&shadow->view, light.position, center, up);
+  get_projection_mat(&shadow->projection, 90., 1., 1., 20.);
+  get_translation_mat(&t_occluder, 0., 0., 2.);
+  begin_shadow_pass(render, shadow);
+  draw_indexed(render, plane_mesh);
+  render->transform.world = &t_occluder;
+  transform_update(&render->transform);
+  draw_indexed(render, occluder_mesh);
+  render->transform.world = &t_world;
+  end_shadow_pass(render, shadow);
+  render->shadow = shadow;
+
+  add_light(render, light);
+  // Local lights, only shaded in the tiles they reach
+  add_light(render, (wg_light_t){(wg_point_t){ {{-6., -6., 1., 1.}} }, (wg_color_t){.1, .6, .9}, POINT, (wg_point_t){ {{0.}} }, 6.});
+  add_light(render, (wg_light_t){(wg_point_t){ {{6., -4., 1., 1.}} }, (wg_color_t){.8, .7, .1}, POINT, (wg_point_t){ {{0.}} }, 5.});
+
+  transform_update(&render->transform);
+  render->materialId = 0;
+  draw_indexed(render, plane_mesh);
+  render->transform.world = &t_occluder;
+  transform_update(&render->transform);
+  render->materialId = 1;
+  draw_indexed(render, occluder_mesh);
 
   shade_fragment(render);
   shade_on_buffer(render);
@@ -97,6 +138,15 @@ void test_render() {
   svpng(fp, render->width, render->height, rgb, 0);
   fclose(fp);
 
+  render->shadow = NULL;
+  render->textures = NULL;
+  render->materials = NULL;
+  render->nMaterials = 0;
+  delete_texture(&tex_occluder);
+  delete_texture(&tex_chessboard);
+  destroy_shadow_map(shadow);
+  destroy_mesh(occluder_mesh);
+  free(occluder_mesh);
   destroy_mesh(plane_mesh);
   free(plane_mesh);
 }
@@ -3,17 +3,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-void render_mesh(wg_render_t *render, wg_mesh_t *mesh) {
-  wg_vertex_t *v = assemble_vertex(mesh);
-  uint32_t nv = mesh->nVertex, nt = mesh->nTriangle;
-  uint32_t *tri = mesh->triangle;
-  project_vertexes(render, v, nv);
-  for (int i = 0; i < nt * 3; i += 3) {
-    cull_and_draw_triangle(render, v+tri[i], v+tri[i+1], v+tri[i+2]);
-  }
-  free(v);
-}
-
 void test_render() {
   init_frag_shader_reg();
 
@@ -25,6 +14,8 @@ void test_render() {
   wg_mesh_t *plane_mesh = mesh_plane(20., 20.);
   wg_texture_t *tex_chessboard = get_empty_texture(32, 32);
   set_chessboard_texture(tex_chessboard, 8, 8, 0xffffff, 0xff0000);
+  // Both colors are exact in 565, so BC1 keeps the texture as it is in 1/8 of the memory
+  compress_texture(tex_chessboard, TEX_BC1);
   render->texture = tex_chessboard;
   uint8_t rgb[W * H * 3], *p = rgb;
 
@@ -46,7 +37,7 @@ void test_render() {
   transform_update(&render->transform);
   clear_render(render);
 
-  render_mesh(render, plane_mesh);
+  draw_indexed(render, plane_mesh);
 
   shade_fragment(render);
   shade_on_buffer(render);
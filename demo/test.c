@@ -1,9 +1,13 @@
 #include "wjgl.h"
 #include "svpng.h"
+#include "gbuffer.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <time.h>
+#include <string.h>
+#include <pthread.h>
+#include <math.h>
 
 void test_mat44f() {
   wg_mat44f mat;
@@ -25,44 +29,78 @@ void debug_mat(wg_mat44f *m, const char *name) {
   }
 }
 
-void render_mesh(wg_render_t *render, wg_mesh_t *mesh) {
-  wg_vertex_t *v = assemble_vertex(mesh);
-  uint32_t nv = mesh->nVertex, nt = mesh->nTriangle;
-  uint32_t *tri = mesh->triangle;
-  project_vertexes(render, v, nv);
-  // Clipping in homogenous space
-  for (int i = 0; i < nt * 3; i += 3) {
-    cull_and_draw_triangle(render, v+tri[i], v+tri[i+1], v+tri[i+2]);
-  }
-  free(v);
+/* Matrices of the camera of a test, the render points to them */
+typedef struct {
+  wg_mat44f world, camera, projection;
+} test_camera_t;
+
+/**
+ * @description: Look at the origin from (x, y, z) with y up, through the
+ *  projection every test uses. The world matrix is the identity.
+ */
+void setup_test_camera(wg_render_t *render, test_camera_t *cam, float x, float y, float z) {
+  wg_point_t eye = { {{x, y, z, 1.}} };
+  wg_point_t center = { {{0., 0., 0., 1.}} };
+  wg_point_t up = { {{0., 1., 0., 1.}} };
+  get_identical_mat(&cam->world);
+  get_lookat_mat(&cam->camera, eye, center, up);
+  get_projection_mat(&cam->projection, 60., 1., 15., 100.);
+  render->transform.world = &cam->world;
+  render->transform.camera = &cam->camera;
+  render->transform.projection = &cam->projection;
+  transform_update(&render->transform);
+}
+
+/**
+ * @description: Put back everything a test may change on the shared render.
+ */
+void reset_test_render(wg_render_t *render) {
+  render->renderMode = VERTEX_COLOR;
+  render->rasterMode = RASTER_SCANLINE;
+  render->gbufferMode = GBUFFER_ATTRIBUTES;
+  render->colorFormat = COLOR_R11G11B10;
+  render->sampleMode = BILINEAR;
+  render->fshaderName = "default";
+  render->pipeline = -1;
+  render->cullMode = CULL_NONE;
+  render->frontFace = FRONT_CCW;
+  render->texture = NULL;
+  render->textures = NULL;
+  render->materials = NULL;
+  render->nMaterials = 0;
+  render->materialId = 0;
+  render->shadow = NULL;
+  clear_lights(render);
+}
+
+void draw_mesh_at(wg_render_t *render, wg_mesh_t *mesh, float dx, float dy, float dz) {
+  wg_mat44f *world = render->transform.world;
+  get_translation_mat(world, dx, dy, dz);
+  transform_update(&render->transform);
+  draw_indexed(render, mesh);
+}
+
+int count_covered(wg_render_t *render) {
+  int len = render->width * render->height, n = 0;
+  for (int i = 0; i < len; i ++) n += render->stencil[i];
+  return n;
 }
 
 void test_render() {
   wg_render_t *render = get_render();
-  wg_mat44f t_world, t_camera, t_projection;
-  wg_point_t eye, center, up;
+  test_camera_t cam;
   const int W = 256, H = 256;
   wg_mesh_t *plane_mesh = mesh_plane(50., 20.);
 
-  eye = (wg_point_t){ {{-20., 5., 5., 1.}} };
-  center = (wg_point_t){ {{0., 0., 0., 1.}} };
-  up = (wg_point_t){ {{0., 1., 0., 1.}} };
-
   render->renderMode = VERTEX_COLOR;
 
   set_up_render(render, W, H);
-  get_identical_mat(&t_world);
-  get_lookat_mat(&t_camera, eye, center, up);
-  debug_mat(&t_camera, "camera");
-  get_projection_mat(&t_projection, 60., 1., 15., 100.);
-  render->transform.world = &t_world;
-  render->transform.camera = &t_camera;
-  render->transform.projection = &t_projection;
-  transform_update(&render->transform);
+  setup_test_camera(render, &cam, -20., 5., 5.);
+  debug_mat(&cam.camera, "camera");
   clear_render(render);
   uint8_t rgb[W * H * 3], *p = rgb;
 
-  render_mesh(render, plane_mesh);
+  draw_indexed(render, plane_mesh);
 
   shade_fragment(render);
   shade_on_buffer(render);
@@ -90,11 +128,1003 @@ void test_render() {
   free(plane_mesh);
 }
 
+/* Both rasterizers must cover the same pixels up to edge rounding,
+   and produce the same colors. */
+void test_raster_modes() {
+  wg_render_t *render = get_render();
+  test_camera_t cam;
+  wg_mesh_t *plane_mesh = mesh_plane(50., 20.);
+  int len = render->width * render->height, n_diff = 0, n_covered = 0;
+  uint8_t *stencil = (uint8_t*)malloc(len);
+  uint8_t *color = (uint8_t*)malloc(len * 4);
+
+  setup_test_camera(render, &cam, -20., 5., 5.);
+  get_translation_mat(&cam.world, 3., -2., 0.);
+  transform_update(&render->transform);
+
+  render->rasterMode = RASTER_SCANLINE;
+  clear_render(render);
+  draw_indexed(render, plane_mesh);
+  shade_fragment(render);
+  shade_on_buffer(render);
+  for (int i = 0; i < len; i ++) stencil[i] = render->stencil[i];
+  for (int i = 0; i < len * 4; i ++) color[i] = render->frameBuffer[i];
+
+  // Leave different attributes behind first, so that stale data can't pass
+  get_translation_mat(&cam.world, -3., 4., 0.);
+  transform_update(&render->transform);
+  clear_render(render);
+  draw_indexed(render, plane_mesh);
+  shade_fragment(render);
+  render->rasterMode = RASTER_HALFSPACE;
+  get_translation_mat(&cam.world, 3., -2., 0.);
+  transform_update(&render->transform);
+  clear_render(render);
+  draw_indexed(render, plane_mesh);
+  shade_fragment(render);
+  shade_on_buffer(render);
+  for (int i = 0; i < len; i ++) {
+    n_covered += stencil[i];
+    n_diff += stencil[i] != render->stencil[i];
+    if (stencil[i] && render->stencil[i]) {
+      for (int c = 0; c < 3; c ++) assert(abs(color[i * 4 + c] - render->frameBuffer[i * 4 + c]) <= 2);
+    }
+  }
+  assert(n_covered > 0);
+  assert(n_diff * 100 < n_covered);
+
+  reset_test_render(render);
+  free(stencil);
+  free(color);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+}
+
+/* Hidden surface removal must not depend on the draw order. */
+void test_depth_order() {
+  wg_render_t *render = get_render();
+  test_camera_t cam;
+  wg_mesh_t *plane_mesh = mesh_plane(20., 20.);
+  int len = render->width * render->height;
+  float *depth = (float*)malloc(len * sizeof(float));
+
+  setup_test_camera(render, &cam, 0., 0., 40.);
+
+  for (int mode = RASTER_SCANLINE; mode <= RASTER_HALFSPACE; mode ++) {
+    render->rasterMode = mode;
+    clear_render(render);
+    draw_mesh_at(render, plane_mesh, 0., 0., 5.);
+    draw_mesh_at(render, plane_mesh, 4., 3., 0.);
+    draw_mesh_at(render, plane_mesh, -3., -4., -5.);
+    flush_render(render);
+    for (int i = 0; i < len; i ++) depth[i] = render->zBuffer[i];
+
+    clear_render(render);
+    draw_mesh_at(render, plane_mesh, -3., -4., -5.);
+    draw_mesh_at(render, plane_mesh, 4., 3., 0.);
+    draw_mesh_at(render, plane_mesh, 0., 0., 5.);
+    flush_render(render);
+    for (int i = 0; i < len; i ++) assert(depth[i] == render->zBuffer[i]);
+  }
+
+  reset_test_render(render);
+  free(depth);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+}
+
+/* A huge plane crossing the guard band must still cover the whole screen. */
+void test_clip_guard_band() {
+  wg_render_t *render = get_render();
+  test_camera_t cam;
+  wg_point_t eye = { {{0., -30., 20., 1.}} };
+  wg_point_t center = { {{0., 0., 0., 1.}} };
+  wg_point_t up = { {{0., 0., 1., 1.}} };
+  wg_mesh_t *plane_mesh = mesh_plane(10000., 10000.);
+  int len = render->width * render->height, n_covered = 0;
+
+  setup_test_camera(render, &cam, eye.x, eye.y, eye.z);
+  // Looking along +y with z up
+  get_lookat_mat(&cam.camera, eye, center, up);
+  transform_update(&render->transform);
+
+  for (int mode = RASTER_SCANLINE; mode <= RASTER_HALFSPACE; mode ++) {
+    render->rasterMode = mode;
+    clear_render(render);
+    draw_indexed(render, plane_mesh);
+    flush_render(render);
+    n_covered = 0;
+    for (int i = 0; i < len; i ++) n_covered += render->stencil[i];
+    // The far plane cuts the top of the screen, the bottom must be covered
+    assert(n_covered > len / 4 && n_covered < len);
+    for (int x = 0; x < render->width; x ++) {
+      assert(render->stencil[x + (render->height - 1) * render->width]);
+    }
+  }
+
+  reset_test_render(render);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+}
+
+/* Sharing projected vertexes must rasterize exactly like clipping every triangle on its own. */
+void test_shared_vertexes() {
+  wg_render_t *render = get_render();
+  test_camera_t cam;
+  // 7 x 7 vertexes 50 apart: the inner ones are inside the guard band, the outer ones beyond it
+  wg_vertex_t grid[49], v[3];
+  uint32_t triangle[36 * 6], *tp = triangle;
+  int len = render->width * render->height;
+  float *depth = (float*)malloc(len * sizeof(float));
+  uint8_t *stencil = (uint8_t*)malloc(len);
+
+  for (int y = 0; y < 6; y ++) {
+    for (int x = 0; x < 6; x ++) {
+      uint32_t i = y * 7 + x;
+      *tp ++ = i; *tp ++ = i + 1; *tp ++ = i + 8;
+      *tp ++ = i; *tp ++ = i + 8; *tp ++ = i + 7;
+    }
+  }
+  setup_test_camera(render, &cam, 0., 0., 40.);
+  render->cullMode = CULL_BACK;
+
+  // Flat, then tilted so that the top rows are also behind the near plane
+  for (int tilt = 0; tilt < 2; tilt ++) {
+    for (int i = 0; i < 49; i ++) {
+      float x = (i % 7) * 50.f - 150.f, y = (i / 7) * 50.f - 150.f;
+      grid[i].vPos = (wg_point_t){ {{x, y, tilt ? y * .6f : 0.f, 1.}} };
+      grid[i].normal = (wg_point_t){ {{0., 0., 1., 0.}} };
+      grid[i].tc = (wg_txcoord_t){ (i % 7) / 6.f, (i / 7) / 6.f };
+      grid[i].vColor = (wg_color_t){ (i % 7) / 6.f, (i / 7) / 6.f, .5 };
+    }
+    clear_render(render);
+    draw_elements(render, grid, 49, triangle, 72);
+    flush_render(render);
+    assert(count_covered(render) > 0);
+    for (int i = 0; i < len; i ++) depth[i] = render->zBuffer[i];
+    for (int i = 0; i < len; i ++) stencil[i] = render->stencil[i];
+
+    clear_render(render);
+    for (int t = 0; t < 72; t ++) {
+      for (int k = 0; k < 3; k ++) v[k] = grid[triangle[t * 3 + k]];
+      project_vertexes(render, v, 3);
+      cull_and_draw_triangle(render, v, v + 1, v + 2);
+    }
+    flush_render(render);
+    for (int i = 0; i < len; i ++) assert(depth[i] == render->zBuffer[i]);
+    for (int i = 0; i < len; i ++) assert(stencil[i] == render->stencil[i]);
+  }
+
+  reset_test_render(render);
+  free(depth);
+  free(stencil);
+}
+
+/* Both color formats must give the same picture up to their precision. */
+void test_color_format() {
+  wg_render_t *render = get_render();
+  test_camera_t cam;
+  wg_mesh_t *plane_mesh = mesh_plane(50., 20.);
+  int len = render->width * render->height, max_diff = 0;
+  uint8_t *color = (uint8_t*)malloc(len * 4);
+
+  setup_test_camera(render, &cam, -20., 5., 5.);
+
+  for (int format = COLOR_RGBA8; format <= COLOR_R11G11B10; format ++) {
+    render->colorFormat = format;
+    clear_render(render);
+    draw_indexed(render, plane_mesh);
+    shade_fragment(render);
+    shade_on_buffer(render);
+    if (format == COLOR_RGBA8) {
+      for (int i = 0; i < len * 4; i ++) color[i] = render->frameBuffer[i];
+      continue;
+    }
+    for (int i = 0; i < len * 4; i ++) {
+      int d = abs(color[i] - render->frameBuffer[i]);
+      max_diff = d > max_diff ? d : max_diff;
+    }
+  }
+  assert(max_diff <= 2);
+
+  reset_test_render(render);
+  free(color);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+}
+
+/* Rebuilding the varyings of the visible triangle must match writing them all. */
+void test_visibility_buffer() {
+  wg_render_t *render = get_render();
+  test_camera_t cam;
+  wg_mesh_t *plane_mesh = mesh_plane(20., 20.);
+  wg_render_target_t *target = create_render_target(render->width, render->height, ATTACH_ALL);
+  int len = render->width * render->height;
+  uint8_t *color = (uint8_t*)malloc(len * 4);
+
+  // Only targets asking for it pay for the primId plane
+  assert(render->gBuffer.primId == NULL && target->gBuffer.primId != NULL);
+  bind_render_target(render, target);
+  setup_test_camera(render, &cam, -20., 5., 30.);
+
+  for (int mode = RASTER_SCANLINE; mode <= RASTER_HALFSPACE; mode ++) {
+    render->rasterMode = mode;
+    for (int gbuffer = GBUFFER_ATTRIBUTES; gbuffer <= GBUFFER_VISIBILITY; gbuffer ++) {
+      render->gbufferMode = gbuffer;
+      clear_render(render);
+      draw_mesh_at(render, plane_mesh, 0., 0., 5.);
+      draw_mesh_at(render, plane_mesh, 4., 3., 0.);
+      draw_mesh_at(render, plane_mesh, -3., -4., -5.);
+      shade_fragment(render);
+      shade_on_buffer(render);
+      if (gbuffer == GBUFFER_ATTRIBUTES) {
+        for (int i = 0; i < len * 4; i ++) color[i] = render->frameBuffer[i];
+        continue;
+      }
+      assert(count_covered(render) > 0);
+      for (int i = 0; i < len * 4; i ++) assert(abs(color[i] - render->frameBuffer[i]) <= 2);
+    }
+  }
+
+  bind_render_target(render, NULL);
+  destroy_render_target(target);
+  reset_test_render(render);
+  free(color);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+}
+
+/* The picture must not depend on the number of worker threads. */
+void test_render_threads() {
+  wg_render_t *render = get_render();
+  test_camera_t cam;
+  wg_mesh_t *plane_mesh = mesh_plane(20., 20.);
+  const int threads[] = {1, 3, 0};
+  int len = render->width * render->height;
+  uint8_t *color = (uint8_t*)malloc(len * 4);
+
+  setup_test_camera(render, &cam, -20., 5., 30.);
+
+  for (int t = 0; t < 3; t ++) {
+    set_render_threads(render, threads[t]);
+    // Several frames on the same pool
+    for (int frame = 0; frame < 4; frame ++) {
+      clear_render(render);
+      draw_mesh_at(render, plane_mesh, 0., 0., 5.);
+      draw_mesh_at(render, plane_mesh, 4., 3., 0.);
+      draw_mesh_at(render, plane_mesh, -3., -4., -5.);
+      shade_fragment(render);
+      shade_on_buffer(render);
+      if (t == 0 && frame == 0) {
+        for (int i = 0; i < len * 4; i ++) color[i] = render->frameBuffer[i];
+      } else {
+        for (int i = 0; i < len * 4; i ++) assert(color[i] == render->frameBuffer[i]);
+      }
+    }
+  }
+
+  free(color);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+}
+
+static void lambert_shader(const wg_render_t *render, wg_gbuff_t *gbuff) {
+  float d = gbuff->normal.x * .3f + gbuff->normal.y * .5f + gbuff->normal.z * .8f;
+  d = d < 0.f ? 0.f : d;
+  gbuff->color.r = gbuff->diffuseColor.r * d + gbuff->tc.x * .1f;
+  gbuff->color.g = gbuff->diffuseColor.g * d + gbuff->vPos.z * .01f;
+  gbuff->color.b = gbuff->diffuseColor.b * d;
+}
+
+static void lambert_shader_batch(const wg_render_t *render, wg_frag_batch_t *batch) {
+  for (int i = 0; i < FRAG_BATCH; i ++) {
+    float d = batch->normal.x[i] * .3f + batch->normal.y[i] * .5f + batch->normal.z[i] * .8f;
+    d = d < 0.f ? 0.f : d;
+    batch->color.r[i] = batch->diffuseColor.r[i] * d + batch->u[i] * .1f;
+    batch->color.g[i] = batch->diffuseColor.g[i] * d + batch->vPos.z[i] * .01f;
+    batch->color.b[i] = batch->diffuseColor.b[i] * d;
+  }
+}
+
+DEFINE_PIPELINE(lambert_pipeline, sampler_bilinear, lambert_shader)
+
+static void* init_registry(void *arg) {
+  init_frag_shader_reg();
+  return NULL;
+}
+
+/* Concurrent inits must each leave the default shader, and drop the pipelines too. */
+void test_shader_registry() {
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i ++) assert(pthread_create(threads + i, NULL, init_registry, NULL) == 0);
+  // Two inits registering "default" after both cleared would trip the uniqueness Assert
+  for (int i = 0; i < 4; i ++) pthread_join(threads[i], NULL);
+
+  wg_pipeline_t pipeline = register_pipeline("TestRegistry", &lambert_pipeline);
+  init_frag_shader_reg();
+  assert(get_pipeline("TestRegistry") == -1);
+  assert(register_pipeline("TestRegistry", &lambert_pipeline) == pipeline);
+  init_frag_shader_reg();
+}
+
+/* Batch shaders & pipelines must shade exactly like the per pixel shader. */
+void test_shader_paths() {
+  wg_render_t *render = get_render();
+  test_camera_t cam;
+  wg_mesh_t *plane_mesh = mesh_plane(20., 20.);
+  wg_texture_t *tex = get_empty_texture(64, 64);
+  const char *shaders[] = {"TestLambert", "TestLambertBatch"};
+  int len = render->width * render->height;
+  uint8_t *color = (uint8_t*)malloc(len * 4);
+
+  init_frag_shader_reg();
+  register_frag_shader("TestLambert", &lambert_shader);
+  register_frag_shader_batch("TestLambertBatch", &lambert_shader_batch);
+  wg_pipeline_t pipeline = register_pipeline("TestLambertBilinear", &lambert_pipeline);
+  assert(get_pipeline("TestLambertBilinear") == pipeline);
+  set_chessboard_texture(tex, 8, 8, 0xffffff, 0x00ff00);
+  setup_test_camera(render, &cam, -10., -5., 20.);
+  render->renderMode = SHADED;
+  render->sampleMode = BILINEAR;
+  render->texture = tex;
+
+  for (int s = 0; s < 3; s ++) {
+    render->fshaderName = shaders[s < 2 ? s : 0];
+    render->pipeline = s < 2 ? -1 : pipeline;
+    clear_render(render);
+    draw_indexed(render, plane_mesh);
+    shade_fragment(render);
+    shade_on_buffer(render);
+    if (s == 0) {
+      assert(count_covered(render) > 0);
+      for (int i = 0; i < len * 4; i ++) color[i] = render->frameBuffer[i];
+    } else {
+      for (int i = 0; i < len * 4; i ++) assert(color[i] == render->frameBuffer[i]);
+    }
+  }
+
+  reset_test_render(render);
+  delete_texture(&tex);
+  free(color);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+}
+
+/* Tiles drawn in one frame and not in the next must read as cleared. */
+void test_lazy_clear() {
+  wg_render_t *render = get_render();
+  test_camera_t cam;
+  wg_mesh_t *plane_mesh = mesh_plane(10., 10.);
+  int len = render->width * render->height;
+  float *depth = (float*)malloc(len * sizeof(float));
+  uint8_t *stencil = (uint8_t*)malloc(len);
+
+  setup_test_camera(render, &cam, 0., 0., 40.);
+
+  clear_render(render);
+  draw_mesh_at(render, plane_mesh, 8., 8., 0.);
+  flush_render(render);
+  for (int i = 0; i < len; i ++) depth[i] = render->zBuffer[i];
+  for (int i = 0; i < len; i ++) stencil[i] = render->stencil[i];
+
+  // Nothing drawn at all
+  clear_render(render);
+  clear_render(render);
+  flush_render(render);
+  assert(count_covered(render) == 0);
+  for (int i = 0; i < len; i ++) assert(render->zBuffer[i] == 1.f);
+
+  // Something else drawn in between
+  draw_mesh_at(render, plane_mesh, -8., -8., 0.);
+  flush_render(render);
+  clear_render(render);
+  draw_mesh_at(render, plane_mesh, 8., 8., 0.);
+  flush_render(render);
+  for (int i = 0; i < len; i ++) assert(depth[i] == render->zBuffer[i]);
+  for (int i = 0; i < len; i ++) assert(stencil[i] == render->stencil[i]);
+
+  free(depth);
+  free(stencil);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+}
+
+/* The shading pass must visit exactly the covered pixels, and pixels covered
+   by an earlier, larger frame only must resolve to black. */
+void test_coverage_resolve() {
+  wg_render_t *render = get_render();
+  test_camera_t cam;
+  wg_mesh_t *big = mesh_plane(40., 40.), *small = mesh_plane(10., 10.);
+  int len = render->width * render->height, n_stale = 0;
+  uint8_t *stencil = (uint8_t*)malloc(len);
+  uint32_t *color = (uint32_t*)malloc(len * sizeof(uint32_t));
+
+  setup_test_camera(render, &cam, 0., 0., 40.);
+
+  clear_render(render);
+  draw_indexed(render, big);
+  flush_render(render);
+  shade_fragment(render);
+  shade_on_buffer(render);
+  for (int i = 0; i < len; i ++) stencil[i] = render->stencil[i];
+  memcpy(color, render->frameBuffer, len * sizeof(uint32_t));
+
+  clear_render(render);
+  draw_mesh_at(render, small, 0., 0., 0.);
+  flush_render(render);
+  // No shaded color packs to all ones, so the pixels left so were not visited
+  memset(render->gBuffer.color, 0xff, len * sizeof(uint32_t));
+  shade_fragment(render);
+  shade_on_buffer(render);
+  assert(count_covered(render) > 0);
+
+  for (int i = 0; i < len; i ++) {
+    assert((render->gBuffer.color[i] != 0xffffffffu) == render->stencil[i]);
+    if (stencil[i] && !render->stencil[i]) {
+      assert(((uint32_t*)render->frameBuffer)[i] == 0);
+      n_stale += color[i] != 0;
+    }
+  }
+  assert(n_stale > 0);
+
+  free(stencil);
+  free(color);
+  destroy_mesh(big);
+  destroy_mesh(small);
+  free(big);
+  free(small);
+}
+
+/* A ranged light must only be listed in the tiles it can reach. */
+void test_light_culling() {
+  wg_render_t *render = get_render();
+  test_camera_t cam;
+  wg_mesh_t *plane_mesh = mesh_plane(20., 20.);
+  wg_point_t none = { {{0., 0., 0., 0.}} };
+  uint32_t tilesX = (render->width + 63) / 64, tilesY = (render->height + 63) / 64;
+  wg_texture_t *tex = get_empty_texture(8, 8);
+  int seen[3] = {0, 0, 0}, live = 0;
+
+  // Lights are in world space, so they may be added before the camera is set
+  clear_lights(render);
+  add_light(render, (wg_light_t){ { {{0., 0., 10., 1.}} }, {1., 1., 1.}, POINT, none, 0. });
+  add_light(render, (wg_light_t){ { {{0., 0., -200., 1.}} }, {1., 1., 1.}, POINT, none, 5. });
+  add_light(render, (wg_light_t){ { {{8., 8., 0., 1.}} }, {1., 1., 1.}, POINT, none, 2. });
+
+  setup_test_camera(render, &cam, 0., 0., 40.);
+  render->renderMode = SHADED;
+  render->fshaderName = "default";
+  render->texture = tex;
+  clear_render(render);
+  draw_indexed(render, plane_mesh);
+  shade_fragment(render);
+
+  for (uint32_t t = 0; t < tilesX * tilesY; t ++) {
+    if (render->tileLightCount[t] > 0) live ++;
+    for (uint32_t i = 0; i < render->tileLightCount[t]; i ++) {
+      seen[render->tileLights[t * render->capLights + i]] ++;
+    }
+  }
+  assert(live > 1);
+  assert(seen[0] == live);
+  assert(seen[1] == 0);
+  assert(seen[2] > 0 && seen[2] < live);
+
+  reset_test_render(render);
+  delete_texture(&tex);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+}
+
+/* The shadow pass must leave the main pass alone, and shadow what is below an occluder. */
+void test_shadow_map() {
+  wg_render_t *render = get_render();
+  test_camera_t cam;
+  wg_mat44f t_occluder;
+  wg_point_t world[3] = { {{{0., 0., 0., 1.}}}, {{{8., 8., 0., 1.}}}, {{{0., 0., 5., 1.}}} }, p;
+  const float expect[3] = {0., 1., 1.};
+  wg_mesh_t *plane_mesh = mesh_plane(20., 20.);
+  wg_mesh_t *occluder_mesh = mesh_plane(4., 4.);
+  wg_shadow_map_t *shadow = create_shadow_map(128);
+  uint32_t width = render->width;
+  int len = render->width * render->height;
+  float *depth = (float*)malloc(len * sizeof(float));
+
+  get_translation_mat(&t_occluder, 0., 0., 5.);
+  setup_test_camera(render, &cam, 0., 0., 40.);
+  clear_render(render);
+  draw_indexed(render, plane_mesh);
+  flush_render(render);
+  for (int i = 0; i < len; i ++) depth[i] = render->zBuffer[i];
+
+  get_lookat_mat(&shadow->view, (wg_point_t){ {{0., 0., 20., 1.}} }, (wg_point_t){ {{0., 0., 0., 1.}} }, (wg_point_t){ {{0., 1., 0., 1.}} });
+  get_projection_mat(&shadow->projection, 60., 1., 1., 50.);
+  begin_shadow_pass(render, shadow);
+  draw_indexed(render, plane_mesh);
+  render->transform.world = &t_occluder;
+  transform_update(&render->transform);
+  draw_indexed(render, occluder_mesh);
+  render->transform.world = &cam.world;
+  end_shadow_pass(render, shadow);
+
+  assert(render->width == width);
+  assert(render->transform.camera == &cam.camera);
+  for (int i = 0; i < len; i ++) assert(depth[i] == render->zBuffer[i]);
+  assert(shadow->target->depth[64 * 128 + 64] < 1.f);
+  render->shadow = shadow;
+  for (int i = 0; i < 3; i ++) {
+    matvecmul4(&cam.camera, &world[i], &p);
+    assert(sample_shadow(render, &p) == expect[i]);
+  }
+
+  reset_test_render(render);
+  destroy_shadow_map(shadow);
+  free(depth);
+  destroy_mesh(occluder_mesh);
+  free(occluder_mesh);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+}
+
+/* Drawing into a render target leaves the default one alone, its colors are a texture. */
+void test_render_target() {
+  wg_render_t *render = get_render();
+  test_camera_t cam;
+  wg_mesh_t *plane_mesh = mesh_plane(20., 20.);
+  wg_texture_t *tex = get_empty_texture(8, 8);
+  wg_render_target_t *target = create_render_target(96, 96, ATTACH_ALL);
+  uint32_t width = render->width;
+  int len = render->width * render->height;
+  uint8_t *color = (uint8_t*)malloc(len * 4);
+  for (int i = 0; i < len * 4; i ++) color[i] = render->frameBuffer[i];
+
+  set_chessboard_texture(tex, 4, 4, 0xffffff, 0x0000ff);
+  setup_test_camera(render, &cam, 0., 0., 40.);
+  render->renderMode = SHADED;
+  render->fshaderName = "default";
+  render->texture = tex;
+
+  bind_render_target(render, target);
+  assert(render->width == 96 && render->frameBuffer == target->color->buffer);
+  clear_render(render);
+  draw_indexed(render, plane_mesh);
+  shade_fragment(render);
+  shade_on_buffer(render);
+  bind_render_target(render, NULL);
+
+  assert(render->width == width && render->target == render->defaultTarget);
+  for (int i = 0; i < len * 4; i ++) assert(color[i] == render->frameBuffer[i]);
+  // Corners are empty, the center is covered by the plane
+  assert(get_pixel(target->color, 0, 0) == 0);
+  assert(get_pixel(target->color, 48, 48) != 0);
+  wg_color_t c = sampler_nearest(target->color, .5, .5, 0.);
+  assert(c.r > 0. || c.g > 0. || c.b > 0.);
+
+  reset_test_render(render);
+  destroy_render_target(target);
+  delete_texture(&tex);
+  free(color);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+}
+
+#define N_CONTEXTS 4
+#define CONTEXT_SIZE 64
+
+static void* render_in_context(void *arg) {
+  uint8_t *out = (uint8_t*)arg;
+  wg_render_t *render = create_render();
+  test_camera_t cam;
+  wg_mesh_t *plane_mesh = mesh_plane(20., 20.);
+
+  set_render_threads(render, 1);
+  set_up_render(render, CONTEXT_SIZE, CONTEXT_SIZE);
+  setup_test_camera(render, &cam, -10., -5., 20.);
+  render->renderMode = VERTEX_COLOR;
+  clear_render(render);
+  draw_indexed(render, plane_mesh);
+  shade_fragment(render);
+  shade_on_buffer(render);
+  memcpy(out, render->frameBuffer, CONTEXT_SIZE * CONTEXT_SIZE * 4);
+
+  destroy_render(render);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+  return NULL;
+}
+
+/* Render contexts driven by concurrent threads must not disturb each other. */
+void test_render_contexts() {
+  const int len = CONTEXT_SIZE * CONTEXT_SIZE * 4;
+  uint8_t *out = (uint8_t*)malloc(N_CONTEXTS * len);
+  pthread_t threads[N_CONTEXTS];
+  int n_covered = 0;
+
+  for (int i = 0; i < N_CONTEXTS; i ++) {
+    assert(pthread_create(threads + i, NULL, render_in_context, out + i * len) == 0);
+  }
+  for (int i = 0; i < N_CONTEXTS; i ++) pthread_join(threads[i], NULL);
+  for (int i = 0; i < len; i ++) n_covered += out[i] != 0;
+  assert(n_covered > 0);
+  for (int i = 1; i < N_CONTEXTS; i ++) assert(memcmp(out, out + i * len, len) == 0);
+  assert(get_render()->width != CONTEXT_SIZE);
+  free(out);
+}
+
+/* Shrinking reuses the block of the default target, growing reallocates it. */
+void test_resize_render() {
+  wg_render_t *render = create_render();
+  test_camera_t cam;
+  wg_mesh_t *plane_mesh = mesh_plane(20., 20.);
+  const int sizes[3] = {128, 72, 256};
+  void *memory = NULL;
+  size_t footprint = 0;
+
+  // A fresh context is fully defined
+  assert(render->renderMode == VERTEX_COLOR && render->sampleMode == BILINEAR && render->pipeline == -1);
+  assert(render->material.diffuse == 1.f && render->nLights == 0 && render->nMaterials == 0 && render->shadow == NULL);
+  set_render_threads(render, 1);
+
+  for (int i = 0; i < 3; i ++) {
+    set_up_render(render, sizes[i], sizes[i]);
+    setup_test_camera(render, &cam, 0., 0., 40.);
+    assert(render->width == sizes[i] && render->transform.w == sizes[i]);
+    assert((uintptr_t)render->zBuffer % 64 == 0 && (uintptr_t)render->gBuffer.color % 64 == 0);
+    if (i == 1) assert(render->target->memory == memory);
+    if (i == 2) assert(render_footprint(render) > footprint);
+    memory = render->target->memory;
+    footprint = render_footprint(render);
+    assert(footprint >= (size_t)sizes[i] * sizes[i] * 27);
+
+    clear_render(render);
+    draw_indexed(render, plane_mesh);
+    shade_fragment(render);
+    shade_on_buffer(render);
+    assert(count_covered(render) > 0);
+    // The plane is centered, the corners stay empty
+    assert(render->stencil[0] == 0 && ((uint32_t*)render->frameBuffer)[0] == 0);
+  }
+
+  destroy_render(render);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+}
+
+/* Minified textures sampled through the mip chain must not alias. */
+void test_mipmaps() {
+  wg_render_t *render = get_render();
+  test_camera_t cam;
+  wg_mesh_t *plane_mesh = mesh_plane(20., 20.);
+  wg_texture_t *tex = get_empty_texture(256, 256);
+  const enum TEX_SAMPLE_MODE modes[3] = {BILINEAR, NEAREST_MIP, TRILINEAR};
+  int len = render->width * render->height;
+
+  // A 1 texel checker averages to linear 0.5
+  set_chessboard_texture(tex, 1, 1, 0xffffff, 0x000000);
+  generate_mipmaps(tex);
+  assert(tex->levels == 9);
+  for (uint32_t l = 1; l < tex->levels; l ++) {
+    uint32_t c = ((uint32_t*)tex->mip[l])[0] & 255;
+    assert(c >= 185 && c <= 187);
+  }
+
+  setup_test_camera(render, &cam, 0., 0., 90.);
+  render->renderMode = SHADED;
+  render->fshaderName = "default";
+  render->texture = tex;
+
+  for (int m = 0; m < 3; m ++) {
+    int lo = 255, hi = 0;
+    render->sampleMode = modes[m];
+    clear_render(render);
+    draw_indexed(render, plane_mesh);
+    shade_fragment(render);
+    shade_on_buffer(render);
+    for (int i = 0; i < len; i ++) {
+      if (!render->stencil[i]) continue;
+      int c = render->frameBuffer[i * 4];
+      lo = c < lo ? c : lo;
+      hi = c > hi ? c : hi;
+    }
+    assert(lo <= hi);
+    if (m == 0) assert(hi - lo > 128);
+    else assert(hi - lo < 16);
+  }
+
+  reset_test_render(render);
+  delete_texture(&tex);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+}
+
+/* Tiled textures must read exactly like linear ones. */
+void test_texture_layout() {
+  wg_texture_t *tex = get_empty_texture(13, 7);
+  wg_sampler_t *samplers[4] = {sampler_nearest, sampler_bilinear, sampler_nearest_mip, sampler_trilinear};
+  uint32_t texels[13 * 7];
+  wg_color_t colors[4][64];
+
+  srand(7);
+  for (int i = 0; i < 13 * 7; i ++) ((uint32_t*)tex->buffer)[i] = texels[i] = rand() & 0xffffff;
+  generate_mipmaps(tex);
+  for (int s = 0; s < 4; s ++) {
+    for (int i = 0; i < 64; i ++) colors[s][i] = samplers[s](tex, (i % 8) / 7.3, (i / 8) / 6.9, -6. + i / 10.);
+  }
+
+  set_texture_layout(tex, LAYOUT_TILED);
+  assert(tex->len == 16 * 8 * 4);
+  // Regenerated in place, and every tile in one cache line
+  generate_mipmaps(tex);
+  for (uint32_t l = 0; l < tex->levels; l ++) assert((uintptr_t)tex->mip[l] % 64 == 0);
+  for (int y = 0; y < 7; y ++) {
+    for (int x = 0; x < 13; x ++) assert(get_pixel(tex, x, y) == texels[y * 13 + x]);
+  }
+  for (int s = 0; s < 4; s ++) {
+    for (int i = 0; i < 64; i ++) {
+      wg_color_t c = samplers[s](tex, (i % 8) / 7.3, (i / 8) / 6.9, -6. + i / 10.);
+      assert(c.r == colors[s][i].r && c.g == colors[s][i].g && c.b == colors[s][i].b);
+    }
+  }
+
+  set_texture_layout(tex, LAYOUT_LINEAR);
+  for (int i = 0; i < 13 * 7; i ++) assert(((uint32_t*)tex->buffer)[i] == texels[i]);
+  delete_texture(&tex);
+}
+
+/* Texels must decode exactly, and colors encode within 1 of powf. */
+void test_gamma_tables() {
+  // Decode through the table is exact
+  wg_texture_t *tex = get_empty_texture(256, 1);
+  for (int i = 0; i < 256; i ++) ((uint32_t*)tex->buffer)[i] = i | (255 - i) << 8;
+  for (int i = 0; i < 256; i ++) {
+    wg_color_t c = sampler_nearest(tex, (i + .5) / 256., .5, 0.);
+    assert(c.r == powf((float)(i / 255.), GAMMA) && c.g == powf((float)((255 - i) / 255.), GAMMA) && c.b == 0.f);
+  }
+  delete_texture(&tex);
+
+  // Encode is within 1 of the rounded powf, and clamped
+  for (int i = 0; i <= 100000; i ++) {
+    float f = i / 100000.f;
+    wg_color_t c = {f, f * f, 1.f - f};
+    uint32_t e = gamma_encode_color(&c);
+    float ch[3] = {c.r, c.g, c.b};
+    for (int k = 0; k < 3; k ++) {
+      int ref = (int)(powf(ch[k], GAMMA_INV) * 255.f + .5f), got = (e >> (k * 8)) & 255;
+      assert(abs(ref - got) <= 1);
+    }
+  }
+  wg_color_t c = {0.f, 1.f, 7.f};
+  assert(gamma_encode_color(&c) == 0xffff00);
+  c = (wg_color_t){-1.f, NAN, 1e-9f};
+  assert(gamma_encode_color(&c) == 0);
+}
+
+/* The resolve must encode every covered pixel like gamma_encode_color,
+   also past the last multiple of 4 of a row. */
+void test_resolve() {
+  wg_render_t *render = create_render();
+  test_camera_t cam;
+  wg_mesh_t *plane_mesh = mesh_plane(60., 60.);
+  const enum COLOR_FORMAT formats[2] = {COLOR_R11G11B10, COLOR_RGBA8};
+
+  set_render_threads(render, 1);
+  set_up_render(render, 70, 70);
+  setup_test_camera(render, &cam, 0., 0., 40.);
+  for (int f = 0; f < 2; f ++) {
+    render->colorFormat = formats[f];
+    clear_render(render);
+    draw_indexed(render, plane_mesh);
+    shade_fragment(render);
+    shade_on_buffer(render);
+    assert(render->stencil[69] && render->stencil[68]);
+    for (int i = 0; i < 70 * 70; i ++) {
+      wg_color_t c = unpack_color(render->colorFormat, render->gBuffer.color[i]);
+      uint32_t expect = render->stencil[i] ? gamma_encode_color(&c) : 0;
+      assert(((uint32_t*)render->frameBuffer)[i] == expect);
+    }
+  }
+
+  destroy_render(render);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+}
+
+/* BC1 must keep colors exact in 565 as they are, BC3 must stay close to a ramp with alpha. */
+void test_texture_compression() {
+  wg_texture_t *tex = get_empty_texture(37, 23), *bc1 = get_empty_texture(37, 23), *bc3 = get_empty_texture(37, 23);
+  // Two colors exact in 565 per 8x8 square, and a ramp between two colors with alpha
+  set_chessboard_texture(bc1, 8, 8, 0xffffff, 0xff0000);
+  for (int y = 0; y < 23; y ++) {
+    for (int x = 0; x < 37; x ++) {
+      uint32_t t = x * 4 + y * 3;
+      ((uint32_t*)tex->buffer)[y * 37 + x] = t | (40 + t / 2) << 8 | (220 - t) << 16 | (uint32_t)(x * 255 / 36) << 24;
+    }
+  }
+  memcpy(bc3->buffer, tex->buffer, tex->len);
+
+  compress_texture(bc1, TEX_BC1);
+  assert(bc1->format == TEX_BC1 && bc1->len == 10 * 6 * 8);
+  for (int y = 0; y < 23; y ++) {
+    for (int x = 0; x < 37; x ++) {
+      assert(get_pixel(bc1, x, y) == (((y / 8 + x / 8) & 1) ? 0xffffffffu : 0xffff0000u));
+    }
+  }
+
+  generate_mipmaps(bc3);
+  compress_texture(bc3, TEX_BC3);
+  assert(bc3->format == TEX_BC3 && bc3->len == 10 * 6 * 16);
+  for (int y = 0; y < 23; y ++) {
+    for (int x = 0; x < 37; x ++) {
+      uint32_t a = get_pixel(tex, x, y), b = get_pixel(bc3, x, y);
+      for (int k = 0; k < 32; k += 8) assert(abs((int)((a >> k) & 255) - (int)((b >> k) & 255)) <= 8);
+    }
+  }
+  for (int i = 0; i < 64; i ++) {
+    float u = (i % 8) / 7.3, v = (i / 8) / 6.9;
+    wg_color_t c0 = sampler_bilinear(tex, u, v, 0.), c1 = sampler_bilinear(bc3, u, v, 0.);
+    assert(fabsf(c0.r - c1.r) < .05 && fabsf(c0.g - c1.g) < .05 && fabsf(c0.b - c1.b) < .05);
+    c1 = sampler_trilinear(bc3, u, v, -2.);
+    assert(c1.r >= 0. && c1.r <= 1.);
+  }
+  delete_texture(&tex);
+  delete_texture(&bc1);
+  delete_texture(&bc3);
+}
+
+static void material_shader(const wg_render_t *render, wg_gbuff_t *gbuff) {
+  gbuff->color = gbuff->diffuseColor;
+  gbuff->color.r *= gbuff->material->diffuse;
+  gbuff->color.g *= gbuff->material->diffuse;
+  gbuff->color.b *= gbuff->material->diffuse;
+}
+
+DEFINE_PIPELINE(material_pipeline, sampler_nearest, material_shader)
+
+/* Every pixel is shaded with the texture & material of the draw that covered it, in one pass. */
+void test_material_ids() {
+  wg_render_t *render = get_render();
+  test_camera_t cam;
+  wg_mesh_t *plane_mesh = mesh_plane(8., 8.);
+  wg_texture_t *textures[2] = {get_empty_texture(1, 1), get_empty_texture(1, 1)};
+  wg_material_t materials[2] = {{0., 1., 0.}, {0., .5, 0.}};
+  wg_render_target_t *target = create_render_target(render->width, render->height, ATTACH_ALL);
+  int len = render->width * render->height;
+  int left = render->height / 2 * render->width + render->width * 2 / 5;
+  int right = render->height / 2 * render->width + render->width * 3 / 5;
+  uint8_t *color = (uint8_t*)malloc(len * 4);
+
+  init_frag_shader_reg();
+  register_frag_shader("TestMaterial", &material_shader);
+  wg_pipeline_t pipeline = register_pipeline("TestMaterialNearest", &material_pipeline);
+  set_chessboard_texture(textures[0], 1, 1, 0, 0x0000ff);
+  set_chessboard_texture(textures[1], 1, 1, 0, 0xff0000);
+  bind_render_target(render, target);
+  setup_test_camera(render, &cam, 0., 0., 40.);
+  render->renderMode = SHADED;
+  render->sampleMode = NEAREST;
+  render->fshaderName = "TestMaterial";
+  render->textures = textures;
+  render->materials = materials;
+  render->nMaterials = 2;
+
+  for (int s = 0; s < 3; s ++) {
+    render->gbufferMode = s == 1 ? GBUFFER_VISIBILITY : GBUFFER_ATTRIBUTES;
+    render->pipeline = s == 2 ? pipeline : -1;
+    clear_render(render);
+    render->materialId = 0;
+    draw_mesh_at(render, plane_mesh, -5., 0., 0.);
+    render->materialId = 1;
+    draw_mesh_at(render, plane_mesh, 5., 0., 0.);
+    shade_fragment(render);
+    shade_on_buffer(render);
+    if (s == 0) {
+      uint8_t *l = render->frameBuffer + left * 4, *r = render->frameBuffer + right * 4;
+      assert(l[0] == 255 && l[1] == 0 && l[2] == 0);
+      assert(r[0] == 0 && r[1] == 0 && r[2] > 100 && r[2] < 255);
+      for (int i = 0; i < len * 4; i ++) color[i] = render->frameBuffer[i];
+    } else {
+      for (int i = 0; i < len * 4; i ++) assert(color[i] == render->frameBuffer[i]);
+    }
+  }
+
+  // Ids without an entry use the first one
+  render->nMaterials = 1;
+  render->pipeline = -1;
+  shade_fragment(render);
+  shade_on_buffer(render);
+  assert(render->frameBuffer[right * 4] == 255 && render->frameBuffer[right * 4 + 2] == 0);
+
+  bind_render_target(render, NULL);
+  destroy_render_target(target);
+  reset_test_render(render);
+  delete_texture(&textures[0]);
+  delete_texture(&textures[1]);
+  free(color);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+}
+
+/* mesh_plane is clockwise when seen from +z. */
+void test_cull_mode() {
+  wg_render_t *render = get_render();
+  test_camera_t cam;
+  wg_mesh_t *plane_mesh = mesh_plane(20., 20.);
+  const int expect[3][2] = {
+    /* FRONT_CCW, FRONT_CW */
+    {1, 1},     // CULL_NONE
+    {1, 0},     // CULL_FRONT
+    {0, 1},     // CULL_BACK
+  };
+
+  setup_test_camera(render, &cam, 0., 0., 40.);
+
+  for (int cull = CULL_NONE; cull <= CULL_BACK; cull ++) {
+    for (int front = FRONT_CCW; front <= FRONT_CW; front ++) {
+      render->cullMode = cull;
+      render->frontFace = front;
+      clear_render(render);
+      draw_indexed(render, plane_mesh);
+      flush_render(render);
+      assert((count_covered(render) > 0) == expect[cull][front]);
+    }
+  }
+
+  reset_test_render(render);
+  destroy_mesh(plane_mesh);
+  free(plane_mesh);
+}
+
 int main() {
   test_mat44f();
   
   test_render();
 
+  test_raster_modes();
+
+  test_depth_order();
+
+  test_clip_guard_band();
+
+  test_shared_vertexes();
+
+  test_cull_mode();
+
+  test_color_format();
+
+  test_visibility_buffer();
+
+  test_render_threads();
+
+  test_shader_registry();
+
+  test_shader_paths();
+
+  test_lazy_clear();
+
+  test_coverage_resolve();
+
+  test_light_culling();
+
+  test_shadow_map();
+
+  test_render_target();
+
+  test_render_contexts();
+
+  test_resize_render();
+
+  test_mipmaps();
+
+  test_texture_layout();
+
+  test_gamma_tables();
+
+  test_resolve();
+
+  test_texture_compression();
+
+  test_material_ids();
+
   printf("All tests are done.\n");
   return 0;
 }
@@ -0,0 +1,177 @@
+#ifndef __GBUFFER_H__
+#define __GBUFFER_H__
+
+/* Packing of the G-buffer planes, inlined into the pipelines of pipeline.h. */
+
+#include <stdint.h>
+#include <math.h>
+#include "render.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static inline uint32_t float_bits(float f) {
+  union { float f; uint32_t u; } v = { f };
+  return v.u;
+}
+
+static inline float bits_float(uint32_t u) {
+  union { uint32_t u; float f; } v = { u };
+  return v.f;
+}
+
+/**
+ * @description: float -> IEEE half, round to nearest. Overflow gives inf.
+ */
+static inline uint16_t float_to_half(float f) {
+  uint32_t x = float_bits(f);
+  uint32_t sign = (x >> 16) & 0x8000, m = x & 0x7fffff;
+  int e = (int)((x >> 23) & 0xff) - 127 + 15;
+  if (e >= 31) return sign | 0x7c00 | ((x & 0x7fffffff) > 0x7f800000 ? 0x200 : 0);
+  if (e <= 0) {
+    // Denormal or zero
+    if (e < -10) return sign;
+    m |= 0x800000;
+    int shift = 14 - e;
+    return sign | ((m + (1u << (shift - 1))) >> shift);
+  }
+  // A carry out of the mantissa correctly bumps the exponent
+  return sign | (((uint32_t)e << 10 | m >> 13) + (m >> 12 & 1));
+}
+
+static inline float half_to_float(uint16_t h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16, e = h >> 10 & 0x1f, m = h & 0x3ff;
+  if (e == 0) return sign ? -ldexpf((float)m, -24) : ldexpf((float)m, -24);
+  if (e == 31) return bits_float(sign | 0x7f800000 | m << 13);
+  return bits_float(sign | (e - 15 + 127) << 23 | m << 13);
+}
+
+static inline uint32_t pack_half2(float x, float y) {
+  return (uint32_t)float_to_half(x) | (uint32_t)float_to_half(y) << 16;
+}
+
+static inline wg_vec2f unpack_half2(uint32_t v) {
+  return (wg_vec2f){half_to_float(v & 0xffff), half_to_float(v >> 16)};
+}
+
+/**
+ * @description: Unsigned float with a 5 bit exponent and mbits of mantissa,
+ *  the channels of R11G11B10. Negative values & NaN become 0, overflow is clamped.
+ */
+static inline uint32_t pack_ufloat(float f, int mbits) {
+  if (!(f > 0.f)) return 0;
+  int drop = 10 - mbits;
+  uint32_t v = ((uint32_t)float_to_half(f) + (1u << (drop - 1))) >> drop;
+  uint32_t max = (31u << mbits) - 1;
+  return v > max ? max : v;
+}
+
+static inline float unpack_ufloat(uint32_t v, int mbits) {
+  return half_to_float((uint16_t)(v << (10 - mbits)));
+}
+
+static inline uint32_t pack_unorm8(float f) {
+  f = f < 0.f ? 0.f : f > 1.f ? 1.f : f;
+  return (uint32_t)(f * 255.f + .5f);
+}
+
+/* Texture footprints are stored as 8 bit fixed point log2 in
+   [-FOOTPRINT_BIAS, 256 / FOOTPRINT_SCALE - FOOTPRINT_BIAS) */
+#define FOOTPRINT_BIAS 16.f
+#define FOOTPRINT_SCALE 8.f
+
+static inline uint8_t pack_footprint(float f) {
+  f = (f + FOOTPRINT_BIAS) * FOOTPRINT_SCALE + .5f;
+  // Also catches -inf & NaN of flat or degenerate gradients
+  if (!(f > 0.f)) return 0;
+  return f > 255.f ? 255 : (uint8_t)f;
+}
+
+static inline float unpack_footprint(uint8_t v) {
+  return v / FOOTPRINT_SCALE - FOOTPRINT_BIAS;
+}
+
+/**
+ * @description: Pack a color in the given enum COLOR_FORMAT.
+ *  RGBA8 keeps r in the lowest byte and alpha at 255.
+ */
+static inline uint32_t pack_color(enum COLOR_FORMAT format, wg_color_t c) {
+  if (format == COLOR_R11G11B10) {
+    return pack_ufloat(c.r, 6) | pack_ufloat(c.g, 6) << 11 | pack_ufloat(c.b, 5) << 22;
+  }
+  return pack_unorm8(c.r) | pack_unorm8(c.g) << 8 | pack_unorm8(c.b) << 16 | 0xff000000u;
+}
+
+static inline wg_color_t unpack_color(enum COLOR_FORMAT format, uint32_t v) {
+  if (format == COLOR_R11G11B10) {
+    return (wg_color_t){unpack_ufloat(v & 0x7ff, 6), unpack_ufloat(v >> 11 & 0x7ff, 6), unpack_ufloat(v >> 22, 5)};
+  }
+  const float s = 1.f / 255.f;
+  return (wg_color_t){(v & 0xff) * s, (v >> 8 & 0xff) * s, (v >> 16 & 0xff) * s};
+}
+
+#ifdef __SSE2__
+/**
+ * @description: unpack_color of 4 packed colors at once, into one vector per channel.
+ */
+static inline void unpack_color_ps(enum COLOR_FORMAT format, __m128i v, __m128 *r, __m128 *g, __m128 *b) {
+  if (format == COLOR_R11G11B10) {
+    // The channels are halves without sign, short of mantissa & never inf. Moved
+    // to the bits of a float, scaling by 2^112 rebiases the exponent, denormals too
+    const __m128 rebias = _mm_castsi128_ps(_mm_set1_epi32(0x77800000));
+    const __m128i m11 = _mm_set1_epi32(0x7ff);
+    *r = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(v, m11), 17)), rebias);
+    *g = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v, 11), m11), 17)), rebias);
+    *b = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(_mm_srli_epi32(v, 22), 18)), rebias);
+  } else {
+    const __m128 s = _mm_set1_ps(1.f / 255.f);
+    const __m128i m8 = _mm_set1_epi32(0xff);
+    *r = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(v, m8)), s);
+    *g = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 8), m8)), s);
+    *b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 16), m8)), s);
+  }
+}
+#endif
+
+static inline uint32_t pack_snorm16(float f) {
+  f = f < -1.f ? -1.f : f > 1.f ? 1.f : f;
+  return (uint32_t)(int32_t)lrintf(f * 32767.f) & 0xffff;
+}
+
+static inline float unpack_snorm16(uint32_t v) {
+  float f = (float)(int16_t)(uint16_t)v * (1.f / 32767.f);
+  return f < -1.f ? -1.f : f;
+}
+
+/**
+ * @description: Octahedral encoding of a direction into 2 x snorm16.
+ *  The length of (x, y, z) does not matter, a zero vector encodes +z.
+ */
+static inline uint32_t pack_normal(float x, float y, float z) {
+  float l1 = fabsf(x) + fabsf(y) + fabsf(z);
+  if (l1 == 0.f) return pack_snorm16(0.f) | pack_snorm16(0.f) << 16;
+  x /= l1, y /= l1;
+  if (z < 0.f) {
+    float ox = x;
+    x = (1.f - fabsf(y)) * (ox >= 0.f ? 1.f : -1.f);
+    y = (1.f - fabsf(ox)) * (y >= 0.f ? 1.f : -1.f);
+  }
+  return pack_snorm16(x) | pack_snorm16(y) << 16;
+}
+
+/**
+ * @description: Decode an octahedral normal, the result has unit length and w = 1.
+ */
+static inline wg_point_t unpack_normal(uint32_t v) {
+  float x = unpack_snorm16(v & 0xffff), y = unpack_snorm16(v >> 16);
+  float z = 1.f - fabsf(x) - fabsf(y);
+  if (z < 0.f) {
+    float ox = x;
+    x = (1.f - fabsf(y)) * (ox >= 0.f ? 1.f : -1.f);
+    y = (1.f - fabsf(ox)) * (y >= 0.f ? 1.f : -1.f);
+  }
+  float inv = 1.f / sqrtf(x * x + y * y + z * z);
+  return (wg_point_t){ {{x * inv, y * inv, z * inv, 1.f}} };
+}
+
+#endif
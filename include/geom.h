@@ -39,6 +39,8 @@ void          matmul(const wg_mat44f *a, const wg_mat44f *b, wg_mat44f *y);
 
 void          matvecmul4(const wg_mat44f *m, const wg_vec4f *b, wg_vec4f *y);
 
+int           matinv(const wg_mat44f *m, wg_mat44f *y);
+
 typedef struct {
   float x, y;
 } wg_vec2f;
@@ -78,6 +80,7 @@ typedef struct {
   float rhw;                // 1/z
 } wg_vertex_t;
 
+/* A fragment unpacked from the G-buffer, as seen by fragment shaders */
 typedef struct {
   wg_vec4f vPosH;           // Homogenous position in form of (x, y, z, w)
   
@@ -85,12 +88,22 @@ typedef struct {
   wg_point_t vPos;          // Screen space position
   wg_point_t normal;        // Normal
   wg_txcoord_t tc;          // Texture coordinates
+  float footprint;          // log2 of the pixel size in uv units, picks the mip level
   wg_color_t vColor;        // Vertex color
 
+  /* Material of the fragment, from the tables of the render if it has any */
+  uint32_t materialId;
+  const struct wg_material *material;
+  const struct wg_texture *texture;
+
   /* The following attributes need to be shaded by fragment shader */
   wg_color_t diffuseColor;  // Diffuse color
   wg_color_t specularColorAdder;      // Light color adder
   wg_color_t color;         // Final color
+
+  /* Indexes into render->viewLights of the lights that may reach the fragment */
+  const uint32_t *lights;
+  uint32_t nLights;
 } wg_gbuff_t;
 
 // Apply transform x -> y
@@ -0,0 +1,108 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include "render.h"
+#include "texture.h"
+#include "gbuffer.h"
+
+/*
+ * Shading pipelines: the SHADED loop of shade_fragment instantiated for one
+ * fixed sampler & fragment shader pair. Both are called directly, so the
+ * compiler may inline the shader into the loop, as well as the unpacking
+ * of the G-buffer, which is inline below. Define one with
+ * DEFINE_PIPELINE in the file of the shader, register it once, keep the
+ * handle and set render->pipeline to it.
+ */
+
+/* Per-frame constants of a shading pass */
+typedef struct {
+  wg_mat44f invProj;        // Inverse of the projection, rebuilds vPos from zBuffer
+} wg_shade_ctx_t;
+
+/* Shade pixel (x0 + k, y) into gBuffer.color for every bit k set in mask */
+typedef void (wg_pipeline_fn_t)(const wg_render_t *render, const wg_shade_ctx_t *ctx, int x0, int y, uint64_t mask);
+
+void rebuild_fragment_varyings(const wg_render_t *render, int i, wg_gbuff_t *frag);
+
+/**
+ * @description: Light list of a tile, see cull_tile_lights.
+ */
+static inline void tile_lights(const wg_render_t *render, uint32_t tile, const uint32_t **lights, uint32_t *n) {
+  if (render->nLights == 0) {
+    *lights = NULL;
+    *n = 0;
+  } else {
+    *lights = render->tileLights + tile * render->capLights;
+    *n = render->tileLightCount[tile];
+  }
+}
+
+/**
+ * @description: Unpack pixel i of gBuffer into a fragment for the shaders.
+ *  vPos is rebuilt from zBuffer through the inverse projection, material &
+ *  texture are looked up by the material id of the pixel.
+ * @param {ctx} Constants of the shading pass.
+ */
+static inline void load_fragment(const wg_render_t *render, const wg_shade_ctx_t *ctx, int i, wg_gbuff_t *frag) {
+  const wg_gbuffer_t *gb = &render->gBuffer;
+  int x = i % render->width, y = i / render->width;
+  float z = render->zBuffer[i];
+  wg_vec4f ndc = { {{(float)x / render->width * 2.f - 1.f, 1.f - (float)y / render->height * 2.f, z, 1.f}} };
+  wg_vec4f p;
+  matvecmul4(&ctx->invProj, &ndc, &p);
+  float w = 1.f / p.w;
+  frag->vPosH = (wg_vec4f){ {{(float)x, (float)y, z, w}} };
+  frag->vPos = (wg_point_t){ {{p.x * w, p.y * w, p.z * w, 1.f}} };
+  if (render->gbufferMode == GBUFFER_VISIBILITY) {
+    rebuild_fragment_varyings(render, i, frag);
+  } else {
+    frag->normal = unpack_normal(gb->normal[i]);
+    frag->tc = unpack_half2(gb->tc[i]);
+    frag->footprint = unpack_footprint(gb->footprint[i]);
+    frag->vColor = unpack_color(render->colorFormat, gb->vColor[i]);
+    frag->materialId = gb->materialId[i];
+  }
+  if (render->nMaterials > 0) {
+    uint32_t id = frag->materialId < render->nMaterials ? frag->materialId : 0;
+    frag->material = render->materials + id;
+    frag->texture = render->textures[id];
+  } else {
+    frag->material = &render->material;
+    frag->texture = render->texture;
+  }
+  frag->diffuseColor = (wg_color_t){0., 0., 0.};
+  frag->specularColorAdder = (wg_color_t){0., 0., 0.};
+  frag->color = (wg_color_t){0., 0., 0.};
+  uint32_t tilesX = (render->width + TILE_SIZE - 1) / TILE_SIZE;
+  tile_lights(render, (y / TILE_SIZE) * tilesX + x / TILE_SIZE, &frag->lights, &frag->nLights);
+}
+
+/**
+ * @description: Store the shaded color of pixel i into gBuffer.
+ */
+static inline void store_fragment_color(const wg_render_t *render, int i, wg_color_t color) {
+  render->gBuffer.color[i] = pack_color(render->colorFormat, color);
+}
+
+/**
+ * @description: Define a static wg_pipeline_fn_t called name.
+ * @param {SAMPLER} Texture sampler, a wg_sampler_t, e.g. sampler_bilinear.
+ * @param {SHADER} Fragment shader, of type wg_fshader_t.
+ */
+#define DEFINE_PIPELINE(name, SAMPLER, SHADER) \
+  static void name(const wg_render_t *render, const wg_shade_ctx_t *ctx, int x0, int y, uint64_t mask) { \
+    for (; mask; mask &= mask - 1) { \
+      int i = y * (int)render->width + x0 + __builtin_ctzll(mask); \
+      wg_gbuff_t frag; \
+      load_fragment(render, ctx, i, &frag); \
+      frag.diffuseColor = SAMPLER(frag.texture, frag.tc.x, frag.tc.y, frag.footprint); \
+      SHADER(render, &frag); \
+      store_fragment_color(render, i, frag.color); \
+    } \
+  }
+
+wg_pipeline_t register_pipeline(const char *name, wg_pipeline_fn_t *fn);
+
+wg_pipeline_t get_pipeline(const char *name);
+
+#endif
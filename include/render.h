@@ -15,16 +15,39 @@ enum LIGHT_TYPE {
 typedef struct {
   wg_point_t position;
   wg_color_t color;
+  enum LIGHT_TYPE type;
+  wg_point_t direction;     // PARALLEL: direction the light travels in
+  float range;              // POINT: radius of influence, 0 for unbounded
 } wg_light_t;
 
 // MATERIAL
-typedef struct {
+typedef struct wg_material {
   // ADS model
   float ambient;
   float diffuse;
   float specular;
 } wg_material_t;
 
+/* Material ids are stored in 8 bits, see gBuffer.materialId */
+#define MAX_MATERIALS 256
+
+// TILES
+/* Post-clip triangles are sorted into TILE_SIZE x TILE_SIZE screen tiles,
+   each tile is then rasterized independently by one worker thread. */
+#define TILE_SIZE 64
+
+typedef struct wg_binner wg_binner_t;
+
+typedef struct wg_hiz wg_hiz_t;
+
+typedef struct wg_vcache wg_vcache_t;
+
+/* Persistent worker threads shared by rasterization and shading */
+typedef struct wg_pool wg_pool_t;
+
+/* Handle of a shading pipeline, see pipeline.h. -1 for none */
+typedef int wg_pipeline_t;
+
 // RENDER
 enum RENDER_MODE {
   FRAMEWORK = 1,
@@ -32,11 +55,143 @@ enum RENDER_MODE {
   SHADED,
 };
 
+/* Vertex attributes interpolated by the rasterizer.
+   Attributes left out of a draw are undefined in gBuffer. */
+enum VARYING {
+  VARYING_POS = 1,          // vPos, rebuilt from zBuffer
+  VARYING_NORMAL = 2,       // normal
+  VARYING_TC = 4,           // tc
+  VARYING_COLOR = 8,        // vColor
+  VARYING_ALL = 15
+};
+
+/* Storage of the color planes of gBuffer */
+enum COLOR_FORMAT {
+  COLOR_RGBA8 = 0,          // 8 bit unorm per channel, clamped to [0, 1]
+  COLOR_R11G11B10           // Unsigned floats, keeps values above 1
+};
+
+/* Structure-of-arrays G-buffer, one packed 32 bit value per pixel in every plane.
+   Positions are not stored, they are rebuilt from zBuffer when shading. */
+typedef struct {
+  uint32_t *normal;         // Octahedral normal, 2 x snorm16
+  uint32_t *tc;             // Texture coordinates, 2 x half float
+  uint32_t *vColor;         // Vertex color, in colorFormat
+  uint32_t *color;          // Shaded color, in colorFormat
+  uint32_t *primId;         // Index of the visible triangle, only with ATTACH_VISIBILITY
+  uint8_t *footprint;       // Texture footprint of the pixel, see pack_footprint
+  uint8_t *materialId;      // render->materialId of the draw, not written in GBUFFER_VISIBILITY
+} wg_gbuffer_t;
+
+/* What the rasterizer writes into gBuffer */
+enum GBUFFER_MODE {
+  GBUFFER_ATTRIBUTES = 0,   // Packed varyings of every fragment passing the depth test
+  GBUFFER_VISIBILITY,       // Only primId, needs ATTACH_VISIBILITY. Varyings are rebuilt by shade_fragment
+  GBUFFER_DEPTH             // Nothing, only zBuffer is written. Used by shadow passes
+};
+
+// RENDER TARGETS
+/* Buffers of a render target */
+enum TARGET_ATTACHMENT {
+  ATTACH_COLOR = 1,         // frameBuffer, written by shade_on_buffer
+  ATTACH_DEPTH = 2,         // zBuffer & stencil, needed to draw
+  ATTACH_GBUFFER = 4,       // gBuffer planes, needed to draw with varyings & to shade
+  ATTACH_VISIBILITY = 8,    // gBuffer.primId, 4 more bytes per pixel, needed by GBUFFER_VISIBILITY
+  ATTACH_ALL = 15
+};
+
+/* Everything draws write into. Bound with bind_render_target, the buffers
+   of the render are then views of the target's attachments. */
+typedef struct {
+  uint32_t width, height;
+
+  /* enum TARGET_ATTACHMENT bits, missing attachments are NULL */
+  uint32_t attachments;
+
+  /* Resolved colors, stored as a texture so they can be sampled as is */
+  wg_texture_t *color;
+  float *depth;
+  uint8_t *stencil;
+  wg_gbuffer_t gBuffer;
+
+  /* Tile state of the rasterizer, part of every target */
+  wg_binner_t *binner;
+  wg_hiz_t *hiz;
+
+  /* Aligned block all attachments are carved from, capacity bytes long */
+  void *memory;
+  size_t capacity;
+} wg_render_target_t;
+
+// SHADOWS
+/* Depth of the scene as seen from a light. Drawn between begin_shadow_pass
+   and end_shadow_pass, then sampled by sample_shadow through render->shadow. */
+typedef struct {
+  /* Width & height in texels */
+  uint32_t size;
+
+  /* Depth only target. Light NDC depth of every texel, 1 where nothing was drawn */
+  wg_render_target_t *target;
+
+  /* Camera & projection of the light, set before begin_shadow_pass */
+  wg_mat44f view, projection;
+
+  /* projection * view * camera^-1: camera space of the main pass to light
+     clip space. Set by end_shadow_pass and shade_fragment */
+  wg_mat44f toLight;
+
+  /* Subtracted from the depth of sampled points against self shadowing */
+  float bias;
+
+  /* PCF kernel radius in texels, 0 for a single tap */
+  int pcf;
+
+  /* State of the main pass while drawing the shadow map */
+  wg_render_target_t *savedTarget;
+  wg_transform_t savedTransform;
+  wg_mat44f savedMat, savedMatP;
+  enum GBUFFER_MODE savedMode;
+} wg_shadow_map_t;
+
+enum RASTER_MODE {
+  RASTER_SCANLINE = 0,      // Trapezoid split + scanline stepping
+  RASTER_HALFSPACE          // Edge functions evaluated over 8x8 blocks
+};
+
+enum CULL_MODE {
+  CULL_NONE = 0,
+  CULL_FRONT,
+  CULL_BACK
+};
+
+/* Winding of front faces, as seen on screen with y up */
+enum FRONT_FACE {
+  FRONT_CCW = 0,
+  FRONT_CW
+};
+
 typedef struct {
   /* Render mode */
   enum RENDER_MODE renderMode;
+  enum RASTER_MODE rasterMode;
+
+  /* Format of the gBuffer colors, set before drawing */
+  enum COLOR_FORMAT colorFormat;
+
+  /* Content of gBuffer, set before drawing */
+  enum GBUFFER_MODE gbufferMode;
+
+  /* enum VARYING bits of the next draws. 0: decided by renderMode */
+  uint32_t varyings;
+
+  /* Face culling */
+  enum CULL_MODE cullMode;
+  enum FRONT_FACE frontFace;
   enum TEX_SAMPLE_MODE sampleMode;
   const char* fshaderName;
+
+  /* Specialized SHADED loop. Takes over sampleMode & fshaderName unless -1 */
+  wg_pipeline_t pipeline;
   
   /* Color: edge, fill. 
      only takes effect when render mode = FRAMEWORK */
@@ -51,27 +206,103 @@ typedef struct {
   /* Texture */
   wg_texture_t *texture;
 
-  /* Light */
+  /* Light of single light shaders, see set_light */
   wg_light_t light;
 
+  /* Light list in world space, see add_light */
+  wg_light_t *lights;
+  /* The light list in camera space, read by the shaders. Filled by shade_fragment */
+  wg_light_t *viewLights;
+  uint32_t nLights, capLights;
+
+  /* Indexes into lights of the lights touching each tile, capLights slots
+     per tile. Filled by shade_fragment, room for lightTiles tiles */
+  uint32_t *tileLights;
+  uint32_t *tileLightCount;
+  uint32_t lightTiles;
+
+  /* Shadow map sampled by sample_shadow, NULL for none */
+  wg_shadow_map_t *shadow;
+
   /* Material */
   wg_material_t material;
 
-  /* buffers */
+  /* Material tables, indexed by the material id of every pixel. Without
+     them (nMaterials == 0) texture & material apply to all pixels. Ids
+     past nMaterials use entry 0 */
+  wg_texture_t **textures;
+  wg_material_t *materials;
+  uint32_t nMaterials;
+
+  /* Material id of the next draws, stored with every pixel they cover */
+  uint8_t materialId;
+
+  /* Bound render target & the one made by set_up_render */
+  wg_render_target_t *target;
+  wg_render_target_t *defaultTarget;
+
+  /* buffers of the bound target */
   uint8_t *stencil;
   uint8_t *frameBuffer;
   float *zBuffer;
-  wg_gbuff_t *gBuffer;
+  wg_gbuffer_t gBuffer;
+
+  /* Coarse min/max of zBuffer */
+  wg_hiz_t *hiz;
+
+  /* Triangles waiting for rasterization */
+  wg_binner_t *binner;
+
+  /* Vertex storage of indexed draws */
+  wg_vcache_t *vcache;
+
+  /* Worker threads, the calling thread included. 0: one per CPU */
+  int nThreads;
+  wg_pool_t *pool;
 } wg_render_t;
 
+wg_render_t* create_render();
+
+void destroy_render(wg_render_t *render);
+
 wg_render_t* get_render();
 
 void set_up_render(wg_render_t *render, int width, int height);
 
+void resize_render(wg_render_t *render, int width, int height);
+
+size_t render_footprint(const wg_render_t *render);
+
 void clear_render(wg_render_t *render);
 
+void set_render_threads(wg_render_t *render, int nThreads);
+
 void set_light(wg_render_t *render, wg_light_t light);
 
+int add_light(wg_render_t *render, wg_light_t light);
+
+void clear_lights(wg_render_t *render);
+
+wg_render_target_t* create_render_target(uint32_t width, uint32_t height, uint32_t attachments);
+
+void resize_render_target(wg_render_target_t *target, uint32_t width, uint32_t height);
+
+void destroy_render_target(wg_render_target_t *target);
+
+size_t render_target_footprint(const wg_render_target_t *target);
+
+void bind_render_target(wg_render_t *render, wg_render_target_t *target);
+
+wg_shadow_map_t* create_shadow_map(uint32_t size);
+
+void destroy_shadow_map(wg_shadow_map_t *shadow);
+
+void begin_shadow_pass(wg_render_t *render, wg_shadow_map_t *shadow);
+
+void end_shadow_pass(wg_render_t *render, wg_shadow_map_t *shadow);
+
+float sample_shadow(const wg_render_t *render, const wg_point_t *vPos);
+
 void shade_vertex(
   const wg_render_t *render, 
   wg_vertex_t *v, size_t size, 
@@ -84,6 +315,14 @@ void project_vertexes(
   wg_vertex_t *v, size_t size
 );
 
+wg_vertex_t* reserve_vertexes(wg_render_t *render, size_t size);
+
+void draw_elements(
+  wg_render_t *render,
+  wg_vertex_t *v, size_t nv,
+  const uint32_t *triangle, size_t nt
+);
+
 void cull_and_draw_triangle(
   const wg_render_t *render,
   const wg_vertex_t *v1,
@@ -91,6 +330,8 @@ void cull_and_draw_triangle(
   const wg_vertex_t *v3
 );
 
+void flush_render(wg_render_t *render);
+
 void shade_fragment(wg_render_t *render);
 
 void shade_on_buffer(wg_render_t *render);
@@ -98,8 +339,46 @@ void shade_on_buffer(wg_render_t *render);
 /* Shaders */
 typedef void (wg_fshader_t)(const wg_render_t* render, wg_gbuff_t* gbuff);
 
+/* Number of fragments handed to a batch shader at once */
+#define FRAG_BATCH 8
+
+typedef struct {
+  float x[FRAG_BATCH], y[FRAG_BATCH], z[FRAG_BATCH];
+} wg_vec3_batch_t;
+
+typedef struct {
+  float r[FRAG_BATCH], g[FRAG_BATCH], b[FRAG_BATCH];
+} wg_color_batch_t;
+
+/* FRAG_BATCH horizontally adjacent fragments in structure-of-arrays form,
+   the batch counterpart of wg_gbuff_t. Lane i is pixel (x + i, y). */
+typedef struct {
+  /* Bit i is set if lane i is covered. Other lanes hold zeros, their results are dropped */
+  uint32_t mask;
+  int x, y;
+
+  wg_vec3_batch_t vPos;
+  wg_vec3_batch_t normal;
+  float u[FRAG_BATCH], v[FRAG_BATCH];
+  float footprint[FRAG_BATCH];
+  wg_color_batch_t vColor;
+  const wg_material_t *material[FRAG_BATCH];
+
+  wg_color_batch_t diffuseColor;
+  wg_color_batch_t specularColorAdder;
+  wg_color_batch_t color;
+
+  /* Indexes into render->viewLights of the lights that may reach the batch */
+  const uint32_t *lights;
+  uint32_t nLights;
+} wg_frag_batch_t;
+
+typedef void (wg_fshader_batch_t)(const wg_render_t* render, wg_frag_batch_t* batch);
+
 void init_frag_shader_reg();
 
 void register_frag_shader(const char* name, wg_fshader_t* shader);
 
+void register_frag_shader_batch(const char* name, wg_fshader_batch_t* shader);
+
 #endif
\ No newline at end of file
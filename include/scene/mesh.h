@@ -17,6 +17,8 @@ typedef struct {
 
 wg_vertex_t *assemble_vertex(const wg_mesh_t *mesh);
 
+void draw_indexed(wg_render_t *render, const wg_mesh_t *mesh);
+
 void destroy_mesh(wg_mesh_t *mesh);
 
 wg_mesh_t *mesh_plane(float w, float h);
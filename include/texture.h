@@ -4,32 +4,95 @@
 #include <stdint.h>
 #include "common.h"
 #include "geom.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 enum TEX_SAMPLE_MODE {
   NEAREST = 0,
-  BILINEAR
+  BILINEAR,
+  NEAREST_MIP,              // Bilinear in the nearest mip level
+  TRILINEAR                 // Bilinear in the two nearest mip levels, blended
 };
 
-typedef struct {
+/* Memory order of the texels of every level */
+enum TEX_LAYOUT {
+  LAYOUT_LINEAR = 0,        // Row major
+  LAYOUT_TILED              // TEX_TILE x TEX_TILE tiles, one cache line each
+};
+
+#define TEX_TILE 4
+
+/* Storage of the texels of every level */
+enum TEX_FORMAT {
+  TEX_RGBA8 = 0,            // 4 bytes per texel, r in the lowest byte
+  TEX_BC1,                  // 8 byte blocks: two 565 colors & 2 bit indices, opaque
+  TEX_BC3                   // 16 byte blocks: interpolated 8 bit alpha, then BC1 colors
+};
+
+/* Block compressed formats store TEX_BLOCK x TEX_BLOCK blocks in row major order */
+#define TEX_BLOCK 4
+
+/* Enough for 32768 x 32768 */
+#define MAX_MIP_LEVELS 16
+
+typedef struct wg_texture {
   uint32_t width, height;
   size_t len;
   uint8_t *buffer;
+
+  /* Layout of buffer & of the mip levels, see set_texture_layout */
+  enum TEX_LAYOUT layout;
+
+  /* TEX_RGBA8 until compress_texture, compressed textures are read only */
+  enum TEX_FORMAT format;
+
+  /* 1 for the color attachment of a render target: buffer lives in the
+     memory of the target, which alone may free or move it */
+  uint8_t targetOwned;
+
+  /* Mip chain, level l is max(1, width >> l) x max(1, height >> l).
+     mip[0] is buffer, there is only that one until generate_mipmaps */
+  uint32_t levels;
+  uint8_t *mip[MAX_MIP_LEVELS];
 } wg_texture_t;
 
+/* A texture sampler. footprint is log2 of the size of the pixel in uv units,
+   see texture_lod, samplers without mip levels ignore it. */
+typedef wg_color_t (wg_sampler_t)(const wg_texture_t *tex, float x, float y, float footprint);
+
 wg_texture_t* get_empty_texture(uint32_t width, uint32_t height);
 
 void delete_texture(wg_texture_t **tex);
 
+void set_texture_layout(wg_texture_t *tex, enum TEX_LAYOUT layout);
+
+void compress_texture(wg_texture_t *tex, enum TEX_FORMAT format);
+
 uint32_t get_pixel(const wg_texture_t *tex, uint32_t x, uint32_t y);
 
+void generate_mipmaps(wg_texture_t *tex);
+
+float texture_lod(const wg_texture_t *tex, float footprint);
+
 void set_chessboard_texture(wg_texture_t *tex, int u, int v, uint32_t c1, uint32_t c2);
 
-wg_color_t sampler_nearest(const wg_texture_t *tex, float x, float y);
+wg_color_t sampler_nearest(const wg_texture_t *tex, float x, float y, float footprint);
+
+wg_color_t sampler_bilinear(const wg_texture_t *tex, float x, float y, float footprint);
+
+wg_color_t sampler_nearest_mip(const wg_texture_t *tex, float x, float y, float footprint);
 
-wg_color_t sampler_bilinear(const wg_texture_t *tex, float x, float y);
+wg_color_t sampler_trilinear(const wg_texture_t *tex, float x, float y, float footprint);
 
-wg_color_t (*load_sampler(enum TEX_SAMPLE_MODE mode))(const wg_texture_t *tex, float x, float y);
+wg_sampler_t* load_sampler(enum TEX_SAMPLE_MODE mode);
 
 wg_color_t gamma_trans(const wg_color_t *c, float pow);
 
+uint32_t gamma_encode_color(const wg_color_t *c);
+
+#ifdef __SSE2__
+__m128i gamma_encode_ps(__m128 r, __m128 g, __m128 b);
+#endif
+
 #endif
\ No newline at end of file
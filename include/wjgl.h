@@ -3,6 +3,7 @@
 
 #include "geom.h"
 #include "render.h"
+#include "pipeline.h"
 #include "scene/mesh.h"
 
 #endif
\ No newline at end of file
@@ -83,6 +83,43 @@ void matvecmul4(const wg_mat44f *m, const wg_vec4f *b, wg_vec4f *y) {
   for (int i = 0; i < 4; i ++) y->v[i] = tmp[i];
 }
 
+/**
+ * @description: Invert a matrix by Gauss-Jordan elimination with partial pivoting.
+ * @param {m} The matrix to invert.
+ * @param {y} Output, may alias m.
+ * @return: 0 if m is singular, y is left untouched then.
+ */
+int matinv(const wg_mat44f *m, wg_mat44f *y) {
+  float a[4][8];
+  for (int i = 0; i < 4; i ++) {
+    for (int j = 0; j < 4; j ++) {
+      a[i][j] = m->m[i][j];
+      a[i][j + 4] = i == j ? 1.f : 0.f;
+    }
+  }
+  for (int c = 0; c < 4; c ++) {
+    int pivot = c;
+    for (int i = c + 1; i < 4; i ++) {
+      if (fabsf(a[i][c]) > fabsf(a[pivot][c])) pivot = i;
+    }
+    if (a[pivot][c] == 0.f) return 0;
+    for (int j = 0; j < 8; j ++) {
+      float t = a[c][j]; a[c][j] = a[pivot][j]; a[pivot][j] = t;
+    }
+    float inv = 1.f / a[c][c];
+    for (int j = 0; j < 8; j ++) a[c][j] *= inv;
+    for (int i = 0; i < 4; i ++) {
+      if (i == c || a[i][c] == 0.f) continue;
+      float f = a[i][c];
+      for (int j = 0; j < 8; j ++) a[i][j] -= f * a[c][j];
+    }
+  }
+  for (int i = 0; i < 4; i ++) {
+    for (int j = 0; j < 4; j ++) y->m[i][j] = a[i][j + 4];
+  }
+  return 1;
+}
+
 /**
  * @description: Get projection matrix.
  * <pre>
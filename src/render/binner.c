@@ -0,0 +1,215 @@
+#include "render.h"
+#include "raster.h"
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * @description: Create an empty binner covering a width x height screen.
+ * @param {width, height} Screen size in pixels.
+ * @return: Pointer to the new binner.
+ */
+wg_binner_t* create_binner(uint32_t width, uint32_t height) {
+  wg_binner_t *binner = (wg_binner_t*)malloc(sizeof(wg_binner_t));
+  uint32_t nTiles;
+  binner->tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+  binner->tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+  nTiles = binner->tilesX * binner->tilesY;
+  binner->tri = NULL;
+  binner->nTri = binner->capTri = 0;
+  binner->bin = (uint32_t**)calloc(nTiles, sizeof(uint32_t*));
+  binner->binSize = (uint32_t*)calloc(nTiles, sizeof(uint32_t));
+  binner->binCap = (uint32_t*)calloc(nTiles, sizeof(uint32_t));
+  binner->coverage = (uint64_t*)calloc(nTiles * TILE_SIZE, sizeof(uint64_t));
+  // Fresh buffers hold garbage
+  binner->tileState = (uint8_t*)malloc(nTiles);
+  memset(binner->tileState, TILE_STALE, nTiles);
+  return binner;
+}
+
+/**
+ * @description: Free a binner and all of its storage.
+ */
+void destroy_binner(wg_binner_t *binner) {
+  uint32_t nTiles = binner->tilesX * binner->tilesY;
+  for (uint32_t i = 0; i < nTiles; i ++) free(binner->bin[i]);
+  free(binner->bin);
+  free(binner->binSize);
+  free(binner->binCap);
+  free(binner->coverage);
+  free(binner->tileState);
+  free(binner->tri);
+  free(binner);
+}
+
+/**
+ * @description: Drop every triangle of the last frame. Storage is kept for reuse.
+ */
+void reset_binner(wg_binner_t *binner) {
+  uint32_t nTiles = binner->tilesX * binner->tilesY;
+  binner->nTri = 0;
+  memset(binner->binSize, 0, nTiles * sizeof(uint32_t));
+}
+
+static wg_rect_t tile_rect(const wg_render_t *render, uint32_t tile) {
+  uint32_t tx = tile % render->binner->tilesX, ty = tile / render->binner->tilesX;
+  wg_rect_t rect = {tx * TILE_SIZE, ty * TILE_SIZE, (tx + 1) * TILE_SIZE, (ty + 1) * TILE_SIZE};
+  if (rect.x1 > (int)render->width) rect.x1 = render->width;
+  if (rect.y1 > (int)render->height) rect.y1 = render->height;
+  return rect;
+}
+
+/**
+ * @description: Logically clear zBuffer, stencil, occupancy & hierarchical z.
+ *  Only tiles drawn since the last clear have anything to reset, see enum TILE_STATE.
+ */
+void clear_tiles(const wg_render_t *render) {
+  wg_binner_t *binner = render->binner;
+  uint32_t nTiles = binner->tilesX * binner->tilesY;
+  for (uint32_t tile = 0; tile < nTiles; tile ++) {
+    if (binner->tileState[tile] != TILE_LIVE) continue;
+    wg_rect_t rect = tile_rect(render, tile);
+    memset(binner->coverage + tile * TILE_SIZE, 0, TILE_SIZE * sizeof(uint64_t));
+    reset_hiz_tile(render->hiz, &rect, tile, CLEAR_DEPTH);
+    binner->tileState[tile] = TILE_STALE;
+  }
+}
+
+static void fill_float(float *p, int n, float v) {
+  int i = 0;
+#ifdef __SSE2__
+  __m128 v4 = _mm_set1_ps(v);
+  for (; i + 4 <= n; i += 4) _mm_storeu_ps(p + i, v4);
+#endif
+  for (; i < n; i ++) p[i] = v;
+}
+
+/**
+ * @description: Write the clear values into the zBuffer & stencil of a tile.
+ */
+static void clean_tile(const wg_render_t *render, uint32_t tile) {
+  wg_rect_t rect = tile_rect(render, tile);
+  int w = rect.x1 - rect.x0;
+  for (int y = rect.y0; y < rect.y1; y ++) {
+    int offset = y * render->width + rect.x0;
+    fill_float(render->zBuffer + offset, w, CLEAR_DEPTH);
+    memset(render->stencil + offset, 0, w);
+  }
+  render->binner->tileState[tile] = TILE_CLEAN;
+}
+
+static void bin_push(wg_binner_t *binner, uint32_t tile, uint32_t idx) {
+  if (binner->binSize[tile] == binner->binCap[tile]) {
+    binner->binCap[tile] = binner->binCap[tile] ? binner->binCap[tile] * 2 : 64;
+    binner->bin[tile] = (uint32_t*)realloc(binner->bin[tile], binner->binCap[tile] * sizeof(uint32_t));
+  }
+  binner->bin[tile][binner->binSize[tile] ++] = idx;
+}
+
+/* Triangles with at most this many pixel centers in their bounding box are tested sample by sample */
+#define SMALL_TRIANGLE_SAMPLES 4
+
+static int covers_sample(const wg_tri_setup_t *setup, int x0, int y0, int x1, int y1) {
+  for (int y = y0; y <= y1; y ++) {
+    for (int x = x0; x <= x1; x ++) {
+      int inside = 1;
+      for (int i = 0; i < 3; i ++) inside &= edge_inside(&setup->e[i], edge_eval(&setup->e[i], (float)x, (float)y));
+      if (inside) return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @description: Set up a post-clip triangle and append it to every tile its bounding box touches.
+ * Pixels are sampled at integer coordinates, so [l, r) covers ceil(l) .. ceil(r) - 1.
+ * Triangles that cover no pixel center are dropped before setup when possible.
+ * @param {render}
+ * @param {v1, v2, v3} Vertexes after transform_homogenous & vertex_init_rhw.
+ */
+void bin_triangle(
+  const wg_render_t *render,
+  const wg_vertex_t *v1,
+  const wg_vertex_t *v2,
+  const wg_vertex_t *v3
+) {
+  wg_binner_t *binner = render->binner;
+  const wg_point_t *p1 = &v1->vPosH, *p2 = &v2->vPosH, *p3 = &v3->vPosH;
+  float minx = fminf(fminf(p1->x, p2->x), p3->x), maxx = fmaxf(fmaxf(p1->x, p2->x), p3->x);
+  float miny = fminf(fminf(p1->y, p2->y), p3->y), maxy = fmaxf(fmaxf(p1->y, p2->y), p3->y);
+  int x0 = (int)ceilf(minx), x1 = (int)ceilf(maxx) - 1;
+  int y0 = (int)ceilf(miny), y1 = (int)ceilf(maxy) - 1;
+  if (x0 < 0) x0 = 0;
+  if (y0 < 0) y0 = 0;
+  if (x1 >= (int)render->width) x1 = render->width - 1;
+  if (y1 >= (int)render->height) y1 = render->height - 1;
+  // No pixel center in the bounding box
+  if (x0 > x1 || y0 > y1) return;
+
+  if (binner->nTri == binner->capTri) {
+    binner->capTri = binner->capTri ? binner->capTri * 2 : 256;
+    binner->tri = (wg_tri_setup_t*)realloc(binner->tri, binner->capTri * sizeof(wg_tri_setup_t));
+  }
+  wg_tri_setup_t *setup = binner->tri + binner->nTri;
+  if (!setup_triangle(setup, v1, v2, v3, live_varyings(render))) return;
+  // Small triangles may still miss all the few pixel centers they touch
+  if ((x1 - x0 + 1) * (y1 - y0 + 1) <= SMALL_TRIANGLE_SAMPLES && !covers_sample(setup, x0, y0, x1, y1)) return;
+  uint32_t idx = binner->nTri ++;
+  setup->id = idx;
+  setup->materialId = render->materialId;
+
+  for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty ++) {
+    for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx ++) {
+      bin_push(binner, ty * binner->tilesX + tx, idx);
+    }
+  }
+}
+
+static void rasterize_tile(const wg_render_t *render, uint32_t tile) {
+  wg_binner_t *binner = render->binner;
+  wg_rect_t rect = tile_rect(render, tile);
+  if (binner->tileState[tile] == TILE_STALE) clean_tile(render, tile);
+  binner->tileState[tile] = TILE_LIVE;
+  for (uint32_t i = 0; i < binner->binSize[tile]; i ++) {
+    const wg_tri_setup_t *setup = binner->tri + binner->bin[tile][i];
+    // The whole triangle is behind what this tile has drawn
+    if (setup->minz >= render->hiz->tileMax[tile]) continue;
+    update_hiz(render, &rect, raster_triangle(render, setup, &rect));
+  }
+}
+
+/**
+ * @description: Tile job of the pool. Tiles never overlap, so the buffers need no locking.
+ */
+static void flush_job(void *arg, uint32_t tile) {
+  const wg_render_t *render = (const wg_render_t*)arg;
+  if (render->binner->binSize[tile] > 0) {
+    rasterize_tile(render, tile);
+  } else if (render->binner->tileState[tile] == TILE_STALE) {
+    clean_tile(render, tile);
+  }
+}
+
+/**
+ * @description: Rasterize every binned triangle into zBuffer/gBuffer, one tile per job
+ *  of the render's worker pool. Afterwards zBuffer & stencil are up to date everywhere.
+ * @param {wg_render_t *render}
+ */
+void flush_render(wg_render_t *render) {
+  wg_binner_t *binner = render->binner;
+  uint32_t nTiles = binner->tilesX * binner->tilesY, nBusy = 0;
+  for (uint32_t i = 0; i < nTiles; i ++) nBusy += binner->binSize[i] > 0 || binner->tileState[i] == TILE_STALE;
+  if (nBusy == 0) return;
+  Assert(render->zBuffer != NULL, "The bound render target has no depth attachment.");
+  Assert(render->gBuffer.normal != NULL || render->gbufferMode == GBUFFER_DEPTH,
+         "The bound render target has no G-buffer, only depth passes can draw into it.");
+  Assert(render->gBuffer.primId != NULL || render->gbufferMode != GBUFFER_VISIBILITY,
+         "The bound render target has no ATTACH_VISIBILITY plane for GBUFFER_VISIBILITY.");
+
+  run_jobs(render->pool, flush_job, render, nTiles);
+
+  for (uint32_t i = 0; i < nTiles; i ++) binner->binSize[i] = 0;
+}
@@ -0,0 +1,102 @@
+#include "render.h"
+#include "raster.h"
+#include <stdlib.h>
+#include <math.h>
+
+/**
+ * @description: Create the hierarchical z buffer of a width x height screen.
+ * @param {width, height} Screen size in pixels.
+ * @return: Pointer to the new hierarchical z buffer.
+ */
+wg_hiz_t* create_hiz(uint32_t width, uint32_t height) {
+  wg_hiz_t *hiz = (wg_hiz_t*)malloc(sizeof(wg_hiz_t));
+  uint32_t nBlocks, nTiles;
+  hiz->blocksX = (width + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+  hiz->blocksY = (height + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+  nBlocks = hiz->blocksX * hiz->blocksY;
+  nTiles = ((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE);
+  hiz->blockMin = (float*)malloc(nBlocks * sizeof(float));
+  hiz->blockMax = (float*)malloc(nBlocks * sizeof(float));
+  hiz->tileMin = (float*)malloc(nTiles * sizeof(float));
+  hiz->tileMax = (float*)malloc(nTiles * sizeof(float));
+  return hiz;
+}
+
+/**
+ * @description: Free a hierarchical z buffer.
+ */
+void destroy_hiz(wg_hiz_t *hiz) {
+  free(hiz->blockMin);
+  free(hiz->blockMax);
+  free(hiz->tileMin);
+  free(hiz->tileMax);
+  free(hiz);
+}
+
+/**
+ * @description: Reset every level to the depth zBuffer is cleared with.
+ */
+void reset_hiz(wg_hiz_t *hiz, float depth) {
+  uint32_t nBlocks = hiz->blocksX * hiz->blocksY;
+  uint32_t tilesX = (hiz->blocksX * HIZ_BLOCK_SIZE + TILE_SIZE - 1) / TILE_SIZE;
+  uint32_t tilesY = (hiz->blocksY * HIZ_BLOCK_SIZE + TILE_SIZE - 1) / TILE_SIZE;
+  for (uint32_t i = 0; i < nBlocks; i ++) hiz->blockMin[i] = hiz->blockMax[i] = depth;
+  for (uint32_t i = 0; i < tilesX * tilesY; i ++) hiz->tileMin[i] = hiz->tileMax[i] = depth;
+}
+
+/**
+ * @description: Reset the blocks of one tile and the tile itself.
+ * @param {rect} Tile rect.
+ * @param {tile} Tile index.
+ */
+void reset_hiz_tile(wg_hiz_t *hiz, const wg_rect_t *rect, uint32_t tile, float depth) {
+  for (int y = rect->y0; y < rect->y1; y += HIZ_BLOCK_SIZE) {
+    for (int x = rect->x0; x < rect->x1; x += HIZ_BLOCK_SIZE) {
+      int b = hiz_block(hiz, x, y);
+      hiz->blockMin[b] = hiz->blockMax[b] = depth;
+    }
+  }
+  hiz->tileMin[tile] = hiz->tileMax[tile] = depth;
+}
+
+/**
+ * @description: Recompute the touched blocks of a tile from zBuffer, then the tile itself.
+ * @param {render}
+ * @param {rect} Tile rect.
+ * @param {touched} Blocks written since last update, see hiz_touch_bit.
+ */
+void update_hiz(const wg_render_t *render, const wg_rect_t *rect, uint64_t touched) {
+  wg_hiz_t *hiz = render->hiz;
+  const int n = TILE_SIZE / HIZ_BLOCK_SIZE;
+  if (touched == 0) return;
+  for (int i = 0; touched; i ++, touched >>= 1) {
+    if (!(touched & 1)) continue;
+    int x0 = rect->x0 + (i % n) * HIZ_BLOCK_SIZE, y0 = rect->y0 + (i / n) * HIZ_BLOCK_SIZE;
+    int x1 = x0 + HIZ_BLOCK_SIZE > rect->x1 ? rect->x1 : x0 + HIZ_BLOCK_SIZE;
+    int y1 = y0 + HIZ_BLOCK_SIZE > rect->y1 ? rect->y1 : y0 + HIZ_BLOCK_SIZE;
+    float lo = INFINITY, hi = -INFINITY;
+    for (int y = y0; y < y1; y ++) {
+      const float *depth = render->zBuffer + render->width * y;
+      for (int x = x0; x < x1; x ++) {
+        lo = fminf(lo, depth[x]);
+        hi = fmaxf(hi, depth[x]);
+      }
+    }
+    int b = hiz_block(hiz, x0, y0);
+    hiz->blockMin[b] = lo;
+    hiz->blockMax[b] = hi;
+  }
+
+  float lo = INFINITY, hi = -INFINITY;
+  for (int y = rect->y0; y < rect->y1; y += HIZ_BLOCK_SIZE) {
+    for (int x = rect->x0; x < rect->x1; x += HIZ_BLOCK_SIZE) {
+      int b = hiz_block(hiz, x, y);
+      lo = fminf(lo, hiz->blockMin[b]);
+      hi = fmaxf(hi, hiz->blockMax[b]);
+    }
+  }
+  uint32_t tilesX = (render->width + TILE_SIZE - 1) / TILE_SIZE;
+  int t = (rect->y0 / TILE_SIZE) * tilesX + rect->x0 / TILE_SIZE;
+  hiz->tileMin[t] = lo;
+  hiz->tileMax[t] = hi;
+}
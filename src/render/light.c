@@ -0,0 +1,114 @@
+#include "render.h"
+#include "raster.h"
+#include <stdlib.h>
+#include <math.h>
+
+/**
+ * @description: Append a light to the light list.
+ * @param {light} Position & direction in world space.
+ * @return: Index of the light in render->lights.
+ */
+int add_light(wg_render_t *render, wg_light_t light) {
+  if (render->nLights == render->capLights) {
+    render->capLights = render->capLights ? render->capLights * 2 : 16;
+    render->lights = (wg_light_t*)realloc(render->lights, render->capLights * sizeof(wg_light_t));
+    render->viewLights = (wg_light_t*)realloc(render->viewLights, render->capLights * sizeof(wg_light_t));
+    render->tileLights = (uint32_t*)realloc(render->tileLights, render->lightTiles * render->capLights * sizeof(uint32_t));
+  }
+  render->lights[render->nLights] = light;
+  render->lights[render->nLights].direction.w = 0.f;
+  return render->nLights ++;
+}
+
+/**
+ * @description: Transform the light list into render->viewLights by the
+ *  current camera, once per shading pass.
+ */
+void update_view_lights(wg_render_t *render) {
+  if (render->nLights == 0) return;
+  Assert(render->transform.camera != NULL, "Lights need a camera.");
+  for (uint32_t i = 0; i < render->nLights; i ++) {
+    const wg_light_t *l = render->lights + i;
+    wg_light_t *v = render->viewLights + i;
+    *v = *l;
+    matvecmul4(render->transform.camera, &l->position, &v->position);
+    matvecmul4(render->transform.camera, &l->direction, &v->direction);
+  }
+}
+
+/**
+ * @description: Remove every light of the light list.
+ */
+void clear_lights(wg_render_t *render) {
+  render->nLights = 0;
+}
+
+/**
+ * @description: Make room for the light lists of nTiles tiles.
+ */
+void reserve_tile_lights(wg_render_t *render, uint32_t nTiles) {
+  if (nTiles <= render->lightTiles) return;
+  render->lightTiles = nTiles;
+  render->tileLights = (uint32_t*)realloc(render->tileLights, nTiles * render->capLights * sizeof(uint32_t));
+  render->tileLightCount = (uint32_t*)realloc(render->tileLightCount, nTiles * sizeof(uint32_t));
+}
+
+/* Camera space position of the screen point (x, y) at depth z */
+static wg_vec4f unproject(const wg_render_t *render, const wg_mat44f *invProj, float x, float y, float z) {
+  wg_vec4f ndc = { {{x / render->width * 2.f - 1.f, 1.f - y / render->height * 2.f, z, 1.f}} }, p;
+  matvecmul4(invProj, &ndc, &p);
+  return v4f_div(p, p.w);
+}
+
+/**
+ * @description: Find the lights that may reach the covered pixels of a tile
+ *  into render->tileLights. The tile is bounded by the camera space box of
+ *  the frustum slice between its nearest & farthest covered depth, and every
+ *  point light's sphere is tested against that box. Parallel lights always pass.
+ * @param {invProj} Inverse of render->transform.projection.
+ * @param {tile} Tile index.
+ */
+void cull_tile_lights(const wg_render_t *render, const wg_mat44f *invProj, uint32_t tile) {
+  const wg_binner_t *binner = render->binner;
+  const uint64_t *coverage = binner->coverage + tile * TILE_SIZE;
+  uint32_t *list = render->tileLights + tile * render->capLights, n = 0;
+  int x0 = (tile % binner->tilesX) * TILE_SIZE, y0 = (tile / binner->tilesX) * TILE_SIZE;
+  float zmin = INFINITY, zmax = -INFINITY;
+  for (int r = 0; r < TILE_SIZE; r ++) {
+    const float *depth = render->zBuffer + (y0 + r) * render->width + x0;
+    for (uint64_t m = coverage[r]; m; m &= m - 1) {
+      float z = depth[__builtin_ctzll(m)];
+      zmin = fminf(zmin, z);
+      zmax = fmaxf(zmax, z);
+    }
+  }
+  render->tileLightCount[tile] = 0;
+  if (zmin > zmax) return;
+
+  wg_vec4f lo = { {{INFINITY, INFINITY, INFINITY, 1.f}} }, hi = { {{-INFINITY, -INFINITY, -INFINITY, 1.f}} };
+  for (int c = 0; c < 8; c ++) {
+    wg_vec4f p = unproject(render, invProj,
+                           (float)(x0 + (c & 1 ? TILE_SIZE : 0)),
+                           (float)(y0 + (c & 2 ? TILE_SIZE : 0)),
+                           c & 4 ? zmax : zmin);
+    for (int k = 0; k < 3; k ++) {
+      lo.v[k] = fminf(lo.v[k], p.v[k]);
+      hi.v[k] = fmaxf(hi.v[k], p.v[k]);
+    }
+  }
+
+  for (uint32_t i = 0; i < render->nLights; i ++) {
+    const wg_light_t *l = render->viewLights + i;
+    if (l->type == POINT && l->range > 0.f) {
+      float d2 = 0.f;
+      for (int k = 0; k < 3; k ++) {
+        float d = l->position.v[k] < lo.v[k] ? lo.v[k] - l->position.v[k] :
+                  l->position.v[k] > hi.v[k] ? l->position.v[k] - hi.v[k] : 0.f;
+        d2 += d * d;
+      }
+      if (d2 > l->range * l->range) continue;
+    }
+    list[n ++] = i;
+  }
+  render->tileLightCount[tile] = n;
+}
@@ -0,0 +1,132 @@
+#include "render.h"
+#include "raster.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+struct wg_pool {
+  /* Threads besides the caller of run_jobs */
+  pthread_t *threads;
+  int nThreads;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake, idle;
+
+  /* Bumped by run_jobs to wake the workers */
+  uint64_t generation;
+  /* Workers still busy with the current generation */
+  int active;
+  int quit;
+
+  /* Current job list */
+  wg_job_fn_t *fn;
+  void *arg;
+  uint32_t nJobs;
+  atomic_uint next;
+};
+
+static void pool_drain(wg_pool_t *pool) {
+  uint32_t i;
+  while ((i = atomic_fetch_add(&pool->next, 1)) < pool->nJobs) {
+    (*pool->fn)(pool->arg, i);
+  }
+}
+
+static void* pool_worker(void *arg) {
+  wg_pool_t *pool = (wg_pool_t*)arg;
+  uint64_t seen = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->quit && pool->generation == seen) pthread_cond_wait(&pool->wake, &pool->lock);
+    if (pool->quit) break;
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+    pool_drain(pool);
+    pthread_mutex_lock(&pool->lock);
+    if (-- pool->active == 0) pthread_cond_signal(&pool->idle);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/**
+ * @description: Start a pool of worker threads. They sleep until run_jobs.
+ * @param {nThreads} Threads working on a job list, the caller of run_jobs
+ *  included. 0 means one per online CPU.
+ * @return: Pointer to the new pool.
+ */
+wg_pool_t* create_pool(int nThreads) {
+  wg_pool_t *pool = (wg_pool_t*)malloc(sizeof(wg_pool_t));
+  if (nThreads <= 0) {
+    long nCpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nThreads = nCpu > 1 ? (int)nCpu : 1;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  pool->generation = 0;
+  pool->active = 0;
+  pool->quit = 0;
+  pool->fn = NULL;
+  pool->arg = NULL;
+  pool->nJobs = 0;
+  atomic_init(&pool->next, 0);
+  pool->threads = (pthread_t*)malloc((nThreads - 1 > 0 ? nThreads - 1 : 1) * sizeof(pthread_t));
+  pool->nThreads = 0;
+  for (int i = 1; i < nThreads; i ++) {
+    if (pthread_create(&pool->threads[pool->nThreads], NULL, pool_worker, pool) == 0) pool->nThreads ++;
+  }
+  return pool;
+}
+
+/**
+ * @description: Stop and join the workers, then free the pool.
+ */
+void destroy_pool(wg_pool_t *pool) {
+  if (pool == NULL) return;
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->nThreads; i ++) pthread_join(pool->threads[i], NULL);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->idle);
+  free(pool->threads);
+  free(pool);
+}
+
+/**
+ * @description: Number of threads working on a job list, the caller included.
+ */
+int pool_size(const wg_pool_t *pool) {
+  return pool->nThreads + 1;
+}
+
+/**
+ * @description: Run fn(arg, i) for every i in [0, nJobs) on the pool and wait
+ *  for all of them. Jobs are handed out one by one in order, the calling
+ *  thread works as one of the workers. Not reentrant.
+ */
+void run_jobs(wg_pool_t *pool, wg_job_fn_t *fn, void *arg, uint32_t nJobs) {
+  if (nJobs == 0) return;
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->nJobs = nJobs;
+  atomic_store(&pool->next, 0);
+  // A single job is not worth waking anyone
+  if (nJobs > 1 && pool->nThreads > 0) {
+    pthread_mutex_lock(&pool->lock);
+    pool->generation ++;
+    pool->active = pool->nThreads;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    pool_drain(pool);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active > 0) pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+  } else {
+    pool_drain(pool);
+  }
+}
@@ -0,0 +1,366 @@
+#ifndef __RASTER_H__
+#define __RASTER_H__
+
+/* Interfaces shared by the files under src/render. Not part of the public API. */
+
+#include "render.h"
+#include "gbuffer.h"
+
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+/* Rasterizer mask bit next to enum VARYING: write the triangle index
+   into gBuffer.primId instead of any varying, see GBUFFER_VISIBILITY. */
+#define VARYING_ID 16
+
+/* Expands X(mask) for every mask live_varyings can return, i.e. every
+   combination of enum VARYING bits but VARYING_POS, and for VARYING_ID. Used
+   to instantiate rasterizer loops specialized on the live varyings. */
+#define FOR_EACH_VARYING_MASK(X) \
+  X(0)  X(2)  X(4)  X(6)  X(8)  X(10) X(12) X(14) \
+  X(16)
+
+/* Screen space rectangle [x0, x1) x [y0, y1) */
+typedef struct {
+  int x0, y0, x1, y1;
+} wg_rect_t;
+
+/*
+ * Edge function of a -> b: E(x, y) = A * x + B * y + C.
+ * Edges of a set up triangle are oriented so that the inside has E > 0.
+ * Pixels exactly on an edge are owned by top & left edges.
+ */
+typedef struct {
+  float A, B, C;
+  int topLeft;
+} wg_edge_t;
+
+/* Slots of the varyings in wg_tri_setup_t. Everything but VS_Z is divided by z.
+   VS_Z & VS_RHW are always live, the others only with their enum VARYING bit.
+   VS_POS is never live in practice, see live_varyings. */
+enum VARYING_SLOT {
+  VS_Z = 0,                 // Depth, affine in screen space
+  VS_RHW,                   // 1/z
+  VS_POS,                   // vPos.xyz
+  VS_NORMAL = VS_POS + 3,   // normal.xyz
+  VS_TC = VS_NORMAL + 3,    // tc.xy
+  VS_COLOR = VS_TC + 2,     // vColor.rgb
+  N_VARYING_SLOT = VS_COLOR + 3
+};
+
+/* A post-clip triangle, ready for rasterization */
+typedef struct {
+  /* Screen space position of the vertexes */
+  wg_vec2f p[3];
+
+  /* Edge functions */
+  wg_edge_t e[3];
+
+  /* Plane of every varying:
+     value(x, y) = c + a * (x - p[0].x) + b * (y - p[0].y) */
+  float a[N_VARYING_SLOT], b[N_VARYING_SLOT], c[N_VARYING_SLOT];
+
+  /* Bounding box */
+  float minx, maxx, miny, maxy;
+
+  /* Depth range */
+  float minz, maxz;
+
+  /* Live enum VARYING bits, planes of the others are not computed */
+  uint32_t varyings;
+
+  /* Index in wg_binner_t.tri */
+  uint32_t id;
+
+  /* render->materialId when the triangle was drawn */
+  uint8_t materialId;
+} wg_tri_setup_t;
+
+typedef uint64_t (wg_raster_fn_t)(const wg_render_t *render, const wg_tri_setup_t *setup, const wg_rect_t *rect);
+
+/* Side of the blocks of the hierarchical z buffer, TILE_SIZE is a multiple of it */
+#define HIZ_BLOCK_SIZE 8
+
+/*
+ * Hierarchical z buffer. Min & max of zBuffer over HIZ_BLOCK_SIZE blocks and
+ * over tiles. Max is always >= the real max, so a triangle whose min depth is
+ * >= max is hidden. Min is only exact between triangles.
+ */
+struct wg_hiz {
+  uint32_t blocksX, blocksY;
+  float *blockMin, *blockMax;
+  float *tileMin, *tileMax;
+};
+
+wg_hiz_t* create_hiz(uint32_t width, uint32_t height);
+
+void destroy_hiz(wg_hiz_t *hiz);
+
+void reset_hiz(wg_hiz_t *hiz, float depth);
+
+void reset_hiz_tile(wg_hiz_t *hiz, const wg_rect_t *rect, uint32_t tile, float depth);
+
+void update_hiz(const wg_render_t *render, const wg_rect_t *rect, uint64_t touched);
+
+static inline int hiz_block(const wg_hiz_t *hiz, int x, int y) {
+  return (y / HIZ_BLOCK_SIZE) * hiz->blocksX + x / HIZ_BLOCK_SIZE;
+}
+
+/* Bit of the block containing (x, y) in the touched mask of a tile rect */
+static inline uint64_t hiz_touch_bit(const wg_rect_t *rect, int x, int y) {
+  return 1ull << (((y - rect->y0) / HIZ_BLOCK_SIZE) * (TILE_SIZE / HIZ_BLOCK_SIZE) + (x - rect->x0) / HIZ_BLOCK_SIZE);
+}
+
+struct wg_binner {
+  /* Number of tiles in x & y */
+  uint32_t tilesX, tilesY;
+
+  /* Triangles submitted since last clear. Kept after flush_render,
+     gBuffer.primId refers to them until the next clear. */
+  wg_tri_setup_t *tri;
+  uint32_t nTri, capTri;
+
+  /* Per-tile triangle index lists, in submission order */
+  uint32_t **bin;
+  uint32_t *binSize, *binCap;
+
+  /* Occupancy of every tile, TILE_SIZE row masks per tile. Bit k of row r
+     is set once pixel (x0 + k, y0 + r) of the tile has been written. */
+  uint64_t *coverage;
+
+  /* enum TILE_STATE of every tile */
+  uint8_t *tileState;
+};
+
+/* Lazy clears. Only the zBuffer & stencil of LIVE tiles are cleared by
+   clear_render, and only logically: they become STALE. A STALE tile is
+   cleared for real when it is first rasterized again, or at the end of
+   the next flush_render if it is not. */
+enum TILE_STATE {
+  TILE_CLEAN = 0,           // zBuffer & stencil hold the clear values
+  TILE_STALE,               // Cleared, but zBuffer & stencil still hold old data
+  TILE_LIVE                 // Drawn since the last clear
+};
+
+/* The value zBuffer is cleared with */
+#define CLEAR_DEPTH 1.f
+
+#if TILE_SIZE != 64
+#error "Tile occupancy rows are uint64_t masks, TILE_SIZE must be 64."
+#endif
+
+/* Occupancy row of the tile row holding pixel (x, y) */
+static inline uint64_t* coverage_row(const wg_binner_t *binner, int x, int y) {
+  int tile = (y / TILE_SIZE) * binner->tilesX + x / TILE_SIZE;
+  return binner->coverage + tile * TILE_SIZE + y % TILE_SIZE;
+}
+
+/* Per-draw vertex storage, reused across draws */
+struct wg_vcache {
+  size_t cap;
+
+  /* Vertexes handed out by reserve_vertexes, projected in place */
+  wg_vertex_t *in;
+
+  /* The same vertexes after transform_homogenous & vertex_init_rhw */
+  wg_vertex_t *screen;
+
+  /* check_cvv outcode, plus VCACHE_CLIP if the vertex needs clipping */
+  uint8_t *code;
+};
+
+#define VCACHE_CLIP 64
+
+/* A job of run_jobs, index is in [0, nJobs) */
+typedef void (wg_job_fn_t)(void *arg, uint32_t index);
+
+wg_pool_t* create_pool(int nThreads);
+
+void destroy_pool(wg_pool_t *pool);
+
+int pool_size(const wg_pool_t *pool);
+
+void run_jobs(wg_pool_t *pool, wg_job_fn_t *fn, void *arg, uint32_t nJobs);
+
+void update_shadow_map(const wg_render_t *render, wg_shadow_map_t *shadow);
+
+void update_view_lights(wg_render_t *render);
+
+void reserve_tile_lights(wg_render_t *render, uint32_t nTiles);
+
+void cull_tile_lights(const wg_render_t *render, const wg_mat44f *invProj, uint32_t tile);
+
+wg_binner_t* create_binner(uint32_t width, uint32_t height);
+
+void destroy_binner(wg_binner_t *binner);
+
+void reset_binner(wg_binner_t *binner);
+
+void clear_tiles(const wg_render_t *render);
+
+void bin_triangle(
+  const wg_render_t *render,
+  const wg_vertex_t *v1,
+  const wg_vertex_t *v2,
+  const wg_vertex_t *v3
+);
+
+int setup_triangle(
+  wg_tri_setup_t *setup,
+  const wg_vertex_t *v1,
+  const wg_vertex_t *v2,
+  const wg_vertex_t *v3,
+  uint32_t varyings
+);
+
+uint64_t raster_triangle(
+  const wg_render_t *render,
+  const wg_tri_setup_t *setup,
+  const wg_rect_t *rect
+);
+
+uint64_t raster_triangle_halfspace(
+  const wg_render_t *render,
+  const wg_tri_setup_t *setup,
+  const wg_rect_t *rect
+);
+
+static inline float edge_eval(const wg_edge_t *e, float x, float y) {
+  return e->A * x + e->B * y + e->C;
+}
+
+static inline int edge_inside(const wg_edge_t *e, float val) {
+  return val > 0.f || (val == 0.f && e->topLeft);
+}
+
+/**
+ * @description: enum VARYING bits the next draw has to interpolate.
+ *  vPos is rebuilt from zBuffer when shading, so it never is. Depth passes
+ *  have none, they run the z only loops.
+ */
+static inline uint32_t live_varyings(const wg_render_t *render) {
+  uint32_t mask = render->varyings;
+  if (render->gbufferMode == GBUFFER_DEPTH) return 0;
+  if (mask == 0 && render->renderMode == VERTEX_COLOR) mask = VARYING_COLOR;
+  if (mask == 0 && render->renderMode == SHADED) mask = VARYING_ALL;
+  return mask & VARYING_ALL & ~VARYING_POS;
+}
+
+/**
+ * @description: Mask the rasterizer loop of a triangle is specialized on.
+ */
+static inline uint32_t raster_mask(const wg_render_t *render, const wg_tri_setup_t *setup) {
+  return render->gbufferMode == GBUFFER_VISIBILITY ? VARYING_ID : setup->varyings;
+}
+
+static inline int varying_slot_live(uint32_t mask, int slot) {
+  if (slot < VS_POS) return 1;
+  if (slot < VS_NORMAL) return (mask & VARYING_POS) != 0;
+  if (slot < VS_TC) return (mask & VARYING_NORMAL) != 0;
+  if (slot < VS_COLOR) return (mask & VARYING_TC) != 0;
+  return (mask & VARYING_COLOR) != 0;
+}
+
+/**
+ * @description: Evaluate the live varyings of a triangle at pixel (x, y).
+ * @param {mask} Live enum VARYING bits. Compile time constant in the specialized loops.
+ */
+ALWAYS_INLINE void setup_eval(const wg_tri_setup_t *setup, float x, float y, float *val, uint32_t mask) {
+  float dx = x - setup->p[0].x, dy = y - setup->p[0].y;
+#define EVAL_SLOTS(first, n) \
+  for (int i = first; i < first + n; i ++) val[i] = setup->c[i] + setup->a[i] * dx + setup->b[i] * dy
+  EVAL_SLOTS(VS_Z, 2);
+  if (mask & VARYING_POS) EVAL_SLOTS(VS_POS, 3);
+  if (mask & VARYING_NORMAL) EVAL_SLOTS(VS_NORMAL, 3);
+  if (mask & VARYING_TC) EVAL_SLOTS(VS_TC, 2);
+  if (mask & VARYING_COLOR) EVAL_SLOTS(VS_COLOR, 3);
+#undef EVAL_SLOTS
+}
+
+/**
+ * @description: Step the live varyings one pixel along x.
+ */
+ALWAYS_INLINE void setup_step_x(const wg_tri_setup_t *setup, float *val, uint32_t mask) {
+#define STEP_SLOTS(first, n) \
+  for (int i = first; i < first + n; i ++) val[i] += setup->a[i]
+  STEP_SLOTS(VS_Z, 2);
+  if (mask & VARYING_POS) STEP_SLOTS(VS_POS, 3);
+  if (mask & VARYING_NORMAL) STEP_SLOTS(VS_NORMAL, 3);
+  if (mask & VARYING_TC) STEP_SLOTS(VS_TC, 2);
+  if (mask & VARYING_COLOR) STEP_SLOTS(VS_COLOR, 3);
+#undef STEP_SLOTS
+}
+
+/**
+ * @description: Screen space derivatives of a perspective corrected varying,
+ *  e.g. d(tc)/dx for texture LOD. With u = P / Q where P & Q are planes:
+ *  du/dx = (P_x * Q - P * Q_x) / Q^2.
+ * @param {slot} The varying.
+ * @param {x, y} Pixel, usually the center of a 2x2 quad.
+ * @param {ddx, ddy} Output.
+ */
+static inline void setup_gradient(const wg_tri_setup_t *setup, int slot, float x, float y, float *ddx, float *ddy) {
+  float dx = x - setup->p[0].x, dy = y - setup->p[0].y;
+  float P = setup->c[slot] + setup->a[slot] * dx + setup->b[slot] * dy;
+  float Q = setup->c[VS_RHW] + setup->a[VS_RHW] * dx + setup->b[VS_RHW] * dy;
+  float inv_q2 = 1.f / (Q * Q);
+  *ddx = (setup->a[slot] * Q - P * setup->a[VS_RHW]) * inv_q2;
+  *ddy = (setup->b[slot] * Q - P * setup->b[VS_RHW]) * inv_q2;
+}
+
+/**
+ * @description: Texture footprint of pixel (x, y): log2 of the larger of the
+ *  uv distances covered by one step along x & along y. The derivatives are
+ *  taken at the center of the 2x2 quad holding the pixel, so all 4 pixels
+ *  pick the same mip level.
+ */
+static inline float setup_footprint(const wg_tri_setup_t *setup, int x, int y) {
+  float cx = (float)(x & ~1) + .5f, cy = (float)(y & ~1) + .5f;
+  float dudx, dudy, dvdx, dvdy;
+  setup_gradient(setup, VS_TC, cx, cy, &dudx, &dudy);
+  setup_gradient(setup, VS_TC + 1, cx, cy, &dvdx, &dvdy);
+  float rho2 = fmaxf(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy);
+  return .5f * log2f(rho2);
+}
+
+/**
+ * @description: Write a fragment that passed the depth test into zBuffer & gBuffer.
+ * @param {setup} The triangle.
+ * @param {x, y} Pixel position.
+ * @param {val} Varyings at the pixel, see setup_eval.
+ * @param {mask} Live enum VARYING bits, only those are written. With VARYING_ID only the triangle index is.
+ */
+ALWAYS_INLINE void write_fragment(
+  const wg_render_t *render,
+  const wg_tri_setup_t *setup,
+  int x, int y,
+  const float *val,
+  uint32_t mask
+) {
+  int offset = render->width * y + x;
+  const wg_gbuffer_t *gb = &render->gBuffer;
+  render->zBuffer[offset] = val[VS_Z];
+  render->stencil[offset] = 1;
+  *coverage_row(render->binner, x, y) |= 1ull << (x % TILE_SIZE);
+  if (mask & VARYING_ID) {
+    gb->primId[offset] = setup->id;
+    return;
+  }
+  if (mask) gb->materialId[offset] = setup->materialId;
+  // The normal is only a direction and w > 0, so it needs no perspective correction
+  if (mask & VARYING_NORMAL) {
+    gb->normal[offset] = pack_normal(val[VS_NORMAL], val[VS_NORMAL + 1], val[VS_NORMAL + 2]);
+  }
+  if (mask & (VARYING_TC | VARYING_COLOR)) {
+    float w = 1.f / val[VS_RHW];
+    if (mask & VARYING_TC) {
+      gb->tc[offset] = pack_half2(val[VS_TC] * w, val[VS_TC + 1] * w);
+      gb->footprint[offset] = pack_footprint(setup_footprint(setup, x, y));
+    }
+    if (mask & VARYING_COLOR) {
+      wg_color_t c = {val[VS_COLOR] * w, val[VS_COLOR + 1] * w, val[VS_COLOR + 2] * w};
+      gb->vColor[offset] = pack_color(render->colorFormat, c);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,178 @@
+#include "render.h"
+#include "raster.h"
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Side of the square blocks the edge functions are tested on */
+#define BLOCK_SIZE HIZ_BLOCK_SIZE
+
+/**
+ * @description: Coverage & depth test of an 8-pixel row segment.
+ * @param {e} Edges.
+ * @param {z0, zA} Depth at pixel x0 and its step along x.
+ * @param {x0, y} First pixel.
+ * @param {lanes} Bits of the pixels inside the rect.
+ * @param {full} Nonzero if the whole block is known to be inside the triangle.
+ * @param {pass} Nonzero if the whole block is known to pass the depth test.
+ * @return: Bit i is set if pixel x0 + i is visible.
+ */
+static unsigned row_mask(
+  const wg_render_t *render,
+  const wg_edge_t e[3],
+  float z0, float zA,
+  int x0, int y,
+  unsigned lanes, int full, int pass
+) {
+  const float *depth = render->zBuffer + render->width * y + x0;
+  unsigned mask = lanes;
+#ifdef __SSE2__
+  const __m128 step = _mm_set_ps(3.f, 2.f, 1.f, 0.f);
+  const __m128 zero = _mm_setzero_ps();
+  unsigned bits[2];
+  for (int h = 0; h < 2; h ++) {
+    float fx = (float)(x0 + 4 * h);
+    __m128 in = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    if (!full) {
+      for (int i = 0; i < 3; i ++) {
+        __m128 val = _mm_add_ps(_mm_set1_ps(edge_eval(&e[i], fx, (float)y)),
+                                _mm_mul_ps(_mm_set1_ps(e[i].A), step));
+        __m128 m = e[i].topLeft ? _mm_cmpge_ps(val, zero) : _mm_cmpgt_ps(val, zero);
+        in = _mm_and_ps(in, m);
+      }
+    }
+    bits[h] = (unsigned)_mm_movemask_ps(in);
+  }
+  mask &= bits[0] | (bits[1] << 4);
+  if (mask == 0 || pass) return mask;
+  // Depth test only for lanes that may be read without leaving the row
+  if (lanes == 0xff) {
+    for (int h = 0; h < 2; h ++) {
+      __m128 z = _mm_add_ps(_mm_set1_ps(z0 + zA * 4 * h), _mm_mul_ps(_mm_set1_ps(zA), step));
+      __m128 d = _mm_loadu_ps(depth + 4 * h);
+      bits[h] = (unsigned)_mm_movemask_ps(_mm_cmplt_ps(z, d));
+    }
+    return mask & (bits[0] | (bits[1] << 4));
+  }
+#else
+  if (!full) {
+    for (int k = 0; k < BLOCK_SIZE; k ++) {
+      for (int i = 0; i < 3; i ++) {
+        if (!edge_inside(&e[i], edge_eval(&e[i], (float)(x0 + k), (float)y))) mask &= ~(1u << k);
+      }
+    }
+  }
+  if (pass) return mask;
+#endif
+  for (int k = 0; k < BLOCK_SIZE; k ++) {
+    if ((mask >> k & 1) && !(z0 + zA * k < depth[k])) mask &= ~(1u << k);
+  }
+  return mask;
+}
+
+/**
+ * @description: Half-space rasterizer, see raster_triangle_halfspace.
+ * @param {mask} Live enum VARYING bits, or VARYING_ID.
+ */
+ALWAYS_INLINE uint64_t raster_halfspace(
+  const wg_render_t *render,
+  const wg_tri_setup_t *setup,
+  const wg_rect_t *rect,
+  const uint32_t mask
+);
+
+/* Half-space rasterizer specialized for every combination of live varyings */
+#define HALFSPACE_VARIANT(m) \
+  static uint64_t raster_halfspace_##m(const wg_render_t *render, const wg_tri_setup_t *setup, const wg_rect_t *rect) { \
+    return raster_halfspace(render, setup, rect, m); \
+  }
+FOR_EACH_VARYING_MASK(HALFSPACE_VARIANT)
+#undef HALFSPACE_VARIANT
+
+#define HALFSPACE_ENTRY(m) [m] = &raster_halfspace_##m,
+static wg_raster_fn_t* const halfspace_variant[VARYING_ID + 1] = { FOR_EACH_VARYING_MASK(HALFSPACE_ENTRY) };
+#undef HALFSPACE_ENTRY
+
+/**
+ * @description: Half-space rasterizer. The bounding box is walked in 8x8 blocks,
+ *  blocks outside any edge are skipped and blocks inside all edges skip the
+ *  per-pixel coverage test. Blocks behind the hierarchical z are skipped as
+ *  well, and blocks in front of it skip the depth test.
+ * @param {render}
+ * @param {setup} Triangle setup, see setup_triangle.
+ * @param {rect} Tile rect. Pixels outside of rect are left untouched.
+ * @return: Mask of the hierarchical z blocks that have been written.
+ */
+uint64_t raster_triangle_halfspace(
+  const wg_render_t *render,
+  const wg_tri_setup_t *setup,
+  const wg_rect_t *rect
+) {
+  return (*halfspace_variant[raster_mask(render, setup)])(render, setup, rect);
+}
+
+ALWAYS_INLINE uint64_t raster_halfspace(
+  const wg_render_t *render,
+  const wg_tri_setup_t *setup,
+  const wg_rect_t *rect,
+  const uint32_t mask
+) {
+  const wg_edge_t *e = setup->e;
+  const wg_hiz_t *hiz = render->hiz;
+  float val[N_VARYING_SLOT];
+  uint64_t touched = 0;
+  int x0 = (int)ceilf(setup->minx), x1 = (int)floorf(setup->maxx) + 1;
+  int y0 = (int)ceilf(setup->miny), y1 = (int)floorf(setup->maxy) + 1;
+  if (x0 < rect->x0) x0 = rect->x0;
+  if (y0 < rect->y0) y0 = rect->y0;
+  if (x1 > rect->x1) x1 = rect->x1;
+  if (y1 > rect->y1) y1 = rect->y1;
+  if (x0 >= x1 || y0 >= y1) return 0;
+
+  const float last = (float)(BLOCK_SIZE - 1);
+  const float zA = setup->a[VS_Z], zB = setup->b[VS_Z];
+  for (int by = y0 & ~(BLOCK_SIZE - 1); by < y1; by += BLOCK_SIZE) {
+    for (int bx = x0 & ~(BLOCK_SIZE - 1); bx < x1; bx += BLOCK_SIZE) {
+      // Trivial reject / accept by the extreme corners of every edge
+      int reject = 0, full = 1;
+      for (int i = 0; i < 3 && !reject; i ++) {
+        float c = edge_eval(&e[i], (float)bx, (float)by);
+        float ax = e[i].A * last, ay = e[i].B * last;
+        float hi = c + (ax > 0.f ? ax : 0.f) + (ay > 0.f ? ay : 0.f);
+        float lo = c + (ax < 0.f ? ax : 0.f) + (ay < 0.f ? ay : 0.f);
+        if (hi < 0.f || (hi == 0.f && !e[i].topLeft)) reject = 1;
+        if (!edge_inside(&e[i], lo)) full = 0;
+      }
+      if (reject) continue;
+
+      // Depth range of the plane over the block, clamped to the triangle
+      int b = hiz_block(hiz, bx, by);
+      float zc = setup->c[VS_Z] + zA * (bx - setup->p[0].x) + zB * (by - setup->p[0].y);
+      float zx = zA * last, zy = zB * last;
+      float zlo = zc + (zx < 0.f ? zx : 0.f) + (zy < 0.f ? zy : 0.f);
+      float zhi = zc + (zx > 0.f ? zx : 0.f) + (zy > 0.f ? zy : 0.f);
+      if (fmaxf(zlo, setup->minz) >= hiz->blockMax[b]) continue;
+      int pass = fminf(zhi, setup->maxz) < hiz->blockMin[b];
+
+      int px0 = bx < x0 ? x0 : bx, px1 = bx + BLOCK_SIZE > x1 ? x1 : bx + BLOCK_SIZE;
+      int py0 = by < y0 ? y0 : by, py1 = by + BLOCK_SIZE > y1 ? y1 : by + BLOCK_SIZE;
+      unsigned lanes = ((1u << (px1 - bx)) - 1) & ~((1u << (px0 - bx)) - 1);
+      for (int y = py0; y < py1; y ++) {
+        // Full rows can be read directly, partial ones start at px0
+        int rx = lanes == 0xff ? bx : px0;
+        unsigned rl = lanes == 0xff ? 0xff : lanes >> (px0 - bx);
+        float z0 = setup->c[VS_Z] + zA * (rx - setup->p[0].x) + zB * (y - setup->p[0].y);
+        unsigned cover = row_mask(render, e, z0, zA, rx, y, rl, full, pass);
+        if (cover) touched |= hiz_touch_bit(rect, bx, by);
+        for (int k = 0; cover; k ++, cover >>= 1) {
+          if (cover & 1) {
+            setup_eval(setup, (float)(rx + k), (float)y, val, mask);
+            write_fragment(render, setup, rx + k, y, val, mask);
+          }
+        }
+      }
+    }
+  }
+  return touched;
+}
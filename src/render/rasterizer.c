@@ -1,87 +1,92 @@
 #include "render.h"
+#include "raster.h"
 #include <stdlib.h>
 #include <math.h>
 
 typedef struct {
-  /* left edge: v1 -> v2 right edge: v3 -> v4. up->down */
-  wg_vertex_t v1, v2, v3, v4;
+  /* left edge: p1 -> p2 right edge: p3 -> p4. up->down */
+  wg_vec2f p1, p2, p3, p4;
 
   /* top & bottom line */
   float top, bottom;
 } wg_trapezoid_t;
 
 typedef struct {
-  /* Starting vertex & vertex step */
-  wg_vertex_t v, step;
-
   /* scanline starting point & width */
   int x, y, w;
 } wg_scanline_t;
 
-static void draw_trapezoid(
-  const wg_render_t *render,
-  const wg_trapezoid_t *t
-);
-
-static void draw_triangle(
-  const wg_render_t *render,
-  const wg_vertex_t *v1,
-  const wg_vertex_t *v2,
-  const wg_vertex_t *v3
-);
-
-static void draw_scanline(
-  const wg_render_t *render,
-  const wg_scanline_t *s
-);
-
 static void swap_ptr(void **a, void **b) {
   void *c = *a;
   *a = *b;
   *b = c;
 }
 
+/* Side planes are clipped at GUARD_BAND times the viewport. Triangles that only
+   leave the viewport are never clipped, the rasterizers scissor them instead. */
+#define GUARD_BAND 4.f
+
+/* Max number of vertexes after clipping a triangle by the 6 planes */
+#define MAX_CLIP_VERTEX 9
+
+/* Clip planes (x y z w) X >= 0, in the bit order of check_cvv */
+static const float clip_plane[6][4] = {
+  { 0.,  0.,  1., 0.},            // near
+  { 0.,  0., -1., 1.},            // far
+  { 1.,  0.,  0., GUARD_BAND},    // left
+  {-1.,  0.,  0., GUARD_BAND},    // right
+  { 0.,  1.,  0., GUARD_BAND},    // bottom
+  { 0., -1.,  0., GUARD_BAND},    // top
+};
+
 /**
  * @description: Returns the point position relative to boundaries.
  *  high -> low
  *  top bottom right left far near
  *  near:   z < 0
  *  far:    z >  w
- *  left:   x < -w
- *  right:  x >  w
- *  bottom: y < -w
- *  top:    y >  w
+ *  left:   x < -band * w
+ *  right:  x >  band * w
+ *  bottom: y < -band * w
+ *  top:    y >  band * w
  * @param {const wg_point_t *p} 
+ * @param {float band} Size of the side planes, 1 for the viewport.
  * @return: int that represents current status.
  */
-static int check_cvv(const wg_point_t *p) {
-  float w = p->w;
+static int check_cvv(const wg_point_t *p, float band) {
+  float w = p->w, bw = band * p->w;
   int res = 0;
   if (p->z < 0.) res |= 1;
   if (p->z >  w) res |= 2;
-  if (p->x < -w) res |= 4;
-  if (p->x >  w) res |= 8;
-  if (p->y < -w) res |= 16;
-  if (p->y >  w) res |= 32;
+  if (p->x < -bw) res |= 4;
+  if (p->x >  bw) res |= 8;
+  if (p->y < -bw) res |= 16;
+  if (p->y >  bw) res |= 32;
   return res;
 }
 
+static float plane_dist(const float *plane, const wg_point_t *p) {
+  return plane[0] * p->x + plane[1] * p->y + plane[2] * p->z + plane[3] * p->w;
+}
+
 /**
- * @description: Returns if directional line v1->v2 intersects plane (x y z w) X = 0.
- * @param {*v1} Pointer to vector 1.
- * @param {*v2} Pointer to vector 2.
- * @param {x, y, z, w} Parameters that define culling plane.
- * @param {*inter} Inter ratio raletive to v1->v2. 
- * @return: int. 1 if intersects.
+ * @description: Sutherland-Hodgman clipping of a convex polygon by one plane.
+ * @param {in, n_in} Input polygon.
+ * @param {plane} The part with plane . X >= 0 is kept.
+ * @param {out} Output polygon, holds at most n_in + 1 vertexes.
+ * @return: Number of output vertexes.
  */
-static int line_border_inter(const wg_point_t *v1, const wg_point_t *v2, float x, float y, float z, float w, float *ratio) {
-  float dist1 = x * v1->x + y * v1->y + z * v1->z + w * v1->w;
-  float dist2 = x * v2->x + y * v2->y + z * v2->z + w * v2->w;
-  if (dist1 * dist2 > 0.f) return 0;
-  *ratio = dist1 / (dist1 - dist2);
-  *ratio = *ratio < 0.f ? -*ratio: *ratio;
-  Assert(*ratio <= 1. && *ratio >= 0., "Ratio must be in [0, 1].");
-  return 1;
+static int clip_polygon(const wg_vertex_t *in, int n_in, const float *plane, wg_vertex_t *out) {
+  int n_out = 0;
+  for (int i = 0; i < n_in; i ++) {
+    const wg_vertex_t *cur = in + i, *next = in + (i + 1) % n_in;
+    float d1 = plane_dist(plane, &cur->vPosH), d2 = plane_dist(plane, &next->vPosH);
+    if (d1 >= 0.f) out[n_out ++] = *cur;
+    if ((d1 >= 0.f) != (d2 >= 0.f)) {
+      vertex_interp(&out[n_out ++], cur, next, d1 / (d1 - d2));
+    }
+  }
+  return n_out;
 }
 
 static int map_coord_to_offset(const wg_render_t *render, int x, int y) {
@@ -89,36 +94,112 @@ static int map_coord_to_offset(const wg_render_t *render, int x, int y) {
 }
 
 static int split_trapezoid(
-  const wg_vertex_t *v1,
-  const wg_vertex_t *v2,
-  const wg_vertex_t *v3,
+  const wg_vec2f *v1,
+  const wg_vec2f *v2,
+  const wg_vec2f *v3,
   wg_trapezoid_t *t1,
   wg_trapezoid_t *t2
 ) {
-  wg_vertex_t vv4;
-  wg_vertex_t *v4 = &vv4;
+  wg_vec2f vv4;
+  const wg_vec2f *v4 = &vv4;
   // y1 < y2 < y3
-  if (v1->vPosH.y > v2->vPosH.y) swap_ptr((void**)(&v1), (void**)(&v2));
-  if (v1->vPosH.y > v3->vPosH.y) swap_ptr((void**)(&v1), (void**)(&v3));
-  if (v2->vPosH.y > v3->vPosH.y) swap_ptr((void**)(&v2), (void**)(&v3));
-  if (v1->vPosH.y == v2->vPosH.y) {
-    if (v1->vPosH.x > v2 -> vPosH.x) swap_ptr((void**)(&v1), (void**)(&v2));
-    *t1 = (wg_trapezoid_t){*v1, *v3, *v2, *v3, v1->vPosH.y, v3->vPosH.y};
+  if (v1->y > v2->y) swap_ptr((void**)(&v1), (void**)(&v2));
+  if (v1->y > v3->y) swap_ptr((void**)(&v1), (void**)(&v3));
+  if (v2->y > v3->y) swap_ptr((void**)(&v2), (void**)(&v3));
+  if (v1->y == v2->y) {
+    if (v1->x > v2->x) swap_ptr((void**)(&v1), (void**)(&v2));
+    *t1 = (wg_trapezoid_t){*v1, *v3, *v2, *v3, v1->y, v3->y};
     return 1;
   }
-  if (v2->vPosH.y == v3->vPosH.y) {
-    if (v2->vPosH.x > v3->vPosH.x) swap_ptr((void**)(&v2), (void**)(&v3));
-    *t1 = (wg_trapezoid_t){*v1, *v2, *v1, *v3, v1->vPosH.y, v2->vPosH.y};
+  if (v2->y == v3->y) {
+    if (v2->x > v3->x) swap_ptr((void**)(&v2), (void**)(&v3));
+    *t1 = (wg_trapezoid_t){*v1, *v2, *v1, *v3, v1->y, v2->y};
     return 1;
   }
-  float _ratio = (v2->vPosH.y - v1->vPosH.y) / (v3->vPosH.y - v1->vPosH.y);
-  vertex_interp(v4, v1, v3, _ratio);
-  if (v2->vPosH.x > v4->vPosH.x) swap_ptr((void**)(&v2), (void**)(&v4));
-  *t1 = (wg_trapezoid_t){*v1, *v2, *v1, *v4, v1->vPosH.y, v2->vPosH.y};
-  *t2 = (wg_trapezoid_t){*v2, *v3, *v4, *v3, v2->vPosH.y, v3->vPosH.y};
+  float _ratio = (v2->y - v1->y) / (v3->y - v1->y);
+  vv4 = (wg_vec2f){lerp(v1->x, v3->x, _ratio), v2->y};
+  if (v2->x > v4->x) swap_ptr((void**)(&v2), (void**)(&v4));
+  *t1 = (wg_trapezoid_t){*v1, *v2, *v1, *v4, v1->y, v2->y};
+  *t2 = (wg_trapezoid_t){*v2, *v3, *v4, *v3, v2->y, v3->y};
   return 2;
 }
 
+static void edge_setup(wg_edge_t *e, float ax, float ay, float bx, float by) {
+  float dx = bx - ax, dy = by - ay;
+  e->A = -dy;
+  e->B = dx;
+  e->C = dy * ax - dx * ay;
+  e->topLeft = dy < 0.f || (dy == 0.f && dx > 0.f);
+}
+
+static void load_varyings(const wg_vertex_t *v, float *val) {
+  val[VS_Z] = v->vPosH.z;
+  val[VS_RHW] = v->rhw;
+  for (int i = 0; i < 3; i ++) val[VS_POS + i] = v->vPos.v[i];
+  for (int i = 0; i < 3; i ++) val[VS_NORMAL + i] = v->normal.v[i];
+  val[VS_TC] = v->tc.x;
+  val[VS_TC + 1] = v->tc.y;
+  val[VS_COLOR] = v->vColor.r;
+  val[VS_COLOR + 1] = v->vColor.g;
+  val[VS_COLOR + 2] = v->vColor.b;
+}
+
+/**
+ * @description: Triangle setup. Computes edges, bounding box and the d/dx, d/dy
+ *  gradients of every live varying, so that pixels never interpolate vertexes again.
+ * @param {setup} Output.
+ * @param {v1, v2, v3} Vertexes after transform_homogenous & vertex_init_rhw.
+ * @param {varyings} Live enum VARYING bits.
+ * @return: int. 0 if the triangle has no area.
+ */
+int setup_triangle(
+  wg_tri_setup_t *setup,
+  const wg_vertex_t *v1,
+  const wg_vertex_t *v2,
+  const wg_vertex_t *v3,
+  uint32_t varyings
+) {
+  const wg_vertex_t *v[3] = {v1, v2, v3};
+  float val[3][N_VARYING_SLOT];
+  float dx1 = v2->vPosH.x - v1->vPosH.x, dy1 = v2->vPosH.y - v1->vPosH.y;
+  float dx2 = v3->vPosH.x - v1->vPosH.x, dy2 = v3->vPosH.y - v1->vPosH.y;
+  float area = dx1 * dy2 - dx2 * dy1;
+  if (area == 0.f) return 0;
+  float inv_area = 1.f / area;
+
+  for (int i = 0; i < 3; i ++) {
+    setup->p[i] = (wg_vec2f){v[i]->vPosH.x, v[i]->vPosH.y};
+    load_varyings(v[i], val[i]);
+  }
+  // Edges are oriented so that the inside is positive
+  if (area > 0.f) {
+    edge_setup(&setup->e[0], setup->p[1].x, setup->p[1].y, setup->p[2].x, setup->p[2].y);
+    edge_setup(&setup->e[1], setup->p[2].x, setup->p[2].y, setup->p[0].x, setup->p[0].y);
+    edge_setup(&setup->e[2], setup->p[0].x, setup->p[0].y, setup->p[1].x, setup->p[1].y);
+  } else {
+    edge_setup(&setup->e[0], setup->p[2].x, setup->p[2].y, setup->p[1].x, setup->p[1].y);
+    edge_setup(&setup->e[1], setup->p[0].x, setup->p[0].y, setup->p[2].x, setup->p[2].y);
+    edge_setup(&setup->e[2], setup->p[1].x, setup->p[1].y, setup->p[0].x, setup->p[0].y);
+  }
+
+  setup->varyings = varyings;
+  for (int i = 0; i < N_VARYING_SLOT; i ++) {
+    if (!varying_slot_live(varyings, i)) continue;
+    float df1 = val[1][i] - val[0][i], df2 = val[2][i] - val[0][i];
+    setup->a[i] = (df1 * dy2 - df2 * dy1) * inv_area;
+    setup->b[i] = (df2 * dx1 - df1 * dx2) * inv_area;
+    setup->c[i] = val[0][i];
+  }
+
+  setup->minx = fminf(fminf(setup->p[0].x, setup->p[1].x), setup->p[2].x);
+  setup->maxx = fmaxf(fmaxf(setup->p[0].x, setup->p[1].x), setup->p[2].x);
+  setup->miny = fminf(fminf(setup->p[0].y, setup->p[1].y), setup->p[2].y);
+  setup->maxy = fmaxf(fmaxf(setup->p[0].y, setup->p[1].y), setup->p[2].y);
+  setup->minz = fminf(fminf(val[0][VS_Z], val[1][VS_Z]), val[2][VS_Z]);
+  setup->maxz = fmaxf(fmaxf(val[0][VS_Z], val[1][VS_Z]), val[2][VS_Z]);
+  return 1;
+}
+
 /**
  * @description: Projects a single vertex (without screen space div)
  * @param {const wg_render_t *render} Render pointer.
@@ -139,9 +220,41 @@ void project_vertexes(
   }
 }
 
+/**
+ * @description: Face culling by the signed screen space area of a polygon.
+ * @return: int. 1 if the polygon must be dropped.
+ */
+static int cull_area(const wg_render_t *render, float area) {
+  // Zero area (seen edge-on) covers nothing
+  if (area == 0.f) return 1;
+  if (render->cullMode == CULL_NONE) return 0;
+  // Screen y points down, so counter clockwise has negative area
+  int front = (area < 0.f) == (render->frontFace == FRONT_CCW);
+  return render->cullMode == CULL_BACK ? !front : front;
+}
+
+/**
+ * @description: Face culling of a clipped polygon in screen space.
+ *  Clipping keeps the winding, so the polygon is culled as a whole.
+ * @param {render}
+ * @param {v, n} Polygon after transform_homogenous.
+ * @return: int. 1 if the polygon must be dropped.
+ */
+static int cull_polygon(const wg_render_t *render, const wg_vertex_t *v, int n) {
+  float area = 0.f;
+  for (int i = 0; i < n; i ++) {
+    const wg_point_t *a = &v[i].vPosH, *b = &v[(i + 1) % n].vPosH;
+    area += a->x * b->y - b->x * a->y;
+  }
+  return cull_area(render, area);
+}
+
 /**
  * @description: Cull and draw triangle.
  * vertex position is unnormalized homogeunous pos.
+ * Triangles entirely outside one plane of the view volume are rejected.
+ * The rest is clipped by the near & far planes, and by the guard band planes
+ * only if a vertex is outside the guard band, then face culled (see cullMode).
  * @param {render}
  * @param {v1}
  * @param {v2}
@@ -153,129 +266,230 @@ void cull_and_draw_triangle(
   const wg_vertex_t *v2,
   const wg_vertex_t *v3
 ) {
-  // near plane culling
-  wg_point_t *p1 = &v1->vPosH, *p2 = &v2->vPosH, *p3 = &v3->vPosH;
-  int cp1 = check_cvv(p1) & 1;
-  int cp2 = check_cvv(p2) & 1;
-  int cp3 = check_cvv(p3) & 1;
-  // Will only deal with near plane culling because only when z is smaller than 0 most of 
-  //   the rasterization algorithms followed will have issue to run correctly.
-  // Also, by doing this, the alogorithm won't be too complicated.
-  // Why clip by z=0? Because this will avoid the "divide by negative z error" in the next
-  //   few steps.
-  wg_vertex_t v[4];         // After culling using z == 0, there are at most 4 different vertexes.
-  int n_vertex = 0;             // Number of vertexes.
-  
-  // Note that in triangle v1 -> v2 -> v3, new vertexes of triangle or quad must be continuous 
-  //   in v1 -> inter -> v2 -> inter -> v3 -> inter. Additionally, inter vertexes must be less
-  //   than or equal to 2.
-  int f;
-  float ratio;
-  if (cp1 == 0) v[n_vertex++] = *v1;
-  f = line_border_inter(&v1->vPosH, &v2->vPosH, 0., 0., 1., 0., &ratio);
-  if (f) {
-    vertex_interp(&v[n_vertex], v1, v2, ratio);
-    ++ n_vertex;
+  const wg_point_t *p1 = &v1->vPosH, *p2 = &v2->vPosH, *p3 = &v3->vPosH;
+  int c1 = check_cvv(p1, 1.f), c2 = check_cvv(p2, 1.f), c3 = check_cvv(p3, 1.f);
+  // Trivial reject: all vertexes are outside the same plane
+  if (c1 & c2 & c3) return;
+  // Near & far are always clipped, sides only outside the guard band.
+  // Clipping by z=0 also avoids the "divide by negative z error" in the next few steps.
+  int clip = (c1 | c2 | c3) & 3;
+  if ((c1 | c2 | c3) & ~3) {
+    clip |= (check_cvv(p1, GUARD_BAND) | check_cvv(p2, GUARD_BAND) | check_cvv(p3, GUARD_BAND)) & ~3;
   }
-  if (cp2 == 0) v[n_vertex++] = *v2;
-  f = line_border_inter(&v2->vPosH, &v3->vPosH, 0., 0., 1., 0., &ratio);
-  if (f) {
-    vertex_interp(&v[n_vertex], v2, v3, ratio);
-    ++ n_vertex;
-  }
-  if (cp3 == 0) v[n_vertex++] = *v3;
-  f = line_border_inter(&v3->vPosH, &v1->vPosH, 0., 0., 1., 0., &ratio);
-  if (f) {
-    vertex_interp(&v[n_vertex], v3, v1, ratio);
-    ++n_vertex;
+
+  wg_vertex_t buf[2][MAX_CLIP_VERTEX];
+  wg_vertex_t *v = buf[0];
+  int n_vertex = 3;
+  v[0] = *v1;
+  v[1] = *v2;
+  v[2] = *v3;
+  for (int i = 0; i < 6 && n_vertex >= 3; i ++) {
+    if (!(clip >> i & 1)) continue;
+    wg_vertex_t *out = v == buf[0] ? buf[1] : buf[0];
+    n_vertex = clip_polygon(v, n_vertex, clip_plane[i], out);
+    v = out;
   }
-  Assert(n_vertex <= 4, "Number of vertexes should be <= 4 after culling!");
+  if (n_vertex < 3) return;
+  Assert(n_vertex <= MAX_CLIP_VERTEX, "Number of vertexes should be <= %d after clipping!", MAX_CLIP_VERTEX);
   for (int i = 0; i < n_vertex; i ++) {
     transform_homogenous(&render->transform, &v[i]);
+  }
+  if (cull_polygon(render, v, n_vertex)) return;
+  for (int i = 0; i < n_vertex; i ++) {
     vertex_init_rhw(&v[i]);
   }
 
-  if (n_vertex <= 2) return;
-  if (n_vertex >= 3) {
-    draw_triangle(render, &v[0], &v[1], &v[2]);
+  // Triangles are only binned here; rasterization happens tile by tile in flush_render.
+  for (int i = 1; i + 1 < n_vertex; i ++) {
+    bin_triangle(render, &v[0], &v[i], &v[i + 1]);
   }
-  if (n_vertex == 4) {
-    draw_triangle(render, &v[0], &v[2], &v[3]);
+}
+
+/**
+ * @description: Get render owned storage for the vertexes of one draw call.
+ *  The storage is reused by the next call, it must not be freed.
+ * @param {render}
+ * @param {size} Number of vertexes.
+ * @return: Pointer to size vertexes.
+ */
+wg_vertex_t* reserve_vertexes(wg_render_t *render, size_t size) {
+  wg_vcache_t *vc = render->vcache;
+  if (vc == NULL) {
+    vc = render->vcache = (wg_vcache_t*)malloc(sizeof(wg_vcache_t));
+    vc->cap = 0;
+    vc->in = vc->screen = NULL;
+    vc->code = NULL;
+  }
+  if (size > vc->cap) {
+    vc->cap = size;
+    vc->in = (wg_vertex_t*)realloc(vc->in, size * sizeof(wg_vertex_t));
+    vc->screen = (wg_vertex_t*)realloc(vc->screen, size * sizeof(wg_vertex_t));
+    vc->code = (uint8_t*)realloc(vc->code, size * sizeof(uint8_t));
   }
+  return vc->in;
 }
 
-static void draw_triangle(
-  const wg_render_t *render,
-  const wg_vertex_t *v1,
-  const wg_vertex_t *v2,
-  const wg_vertex_t *v3
+/**
+ * @description: Draw indexed triangles. Every vertex is projected and divided by
+ *  w once, triangles share the results. Only triangles that need clipping go
+ *  through cull_and_draw_triangle.
+ * @param {render}
+ * @param {v, nv} Vertexes in model space. Projected in place. If v is not the
+ *  storage of reserve_vertexes, it is copied there first.
+ * @param {triangle, nt} Vertex indexes, 3 per triangle.
+ */
+void draw_elements(
+  wg_render_t *render,
+  wg_vertex_t *v, size_t nv,
+  const uint32_t *triangle, size_t nt
 ) {
-  wg_trapezoid_t t1, t2;
-  int n_trape = split_trapezoid(v1, v2, v3, &t1, &t2);
-  draw_trapezoid(render, &t1);
-  if (n_trape > 1) {
-    draw_trapezoid(render, &t2);
+  wg_vertex_t *in = reserve_vertexes(render, nv);
+  wg_vcache_t *vc = render->vcache;
+  if (v != in) {
+    for (size_t i = 0; i < nv; i ++) in[i] = v[i];
+  }
+  project_vertexes(render, in, nv);
+  for (size_t i = 0; i < nv; i ++) {
+    int code = check_cvv(&in[i].vPosH, 1.f);
+    if (check_cvv(&in[i].vPosH, GUARD_BAND) != 0) {
+      code |= VCACHE_CLIP;
+    } else {
+      vc->screen[i] = in[i];
+      transform_homogenous(&render->transform, &vc->screen[i]);
+      vertex_init_rhw(&vc->screen[i]);
+    }
+    vc->code[i] = code;
+  }
+  for (size_t i = 0; i < nt * 3; i += 3) {
+    uint32_t a = triangle[i], b = triangle[i + 1], c = triangle[i + 2];
+    int ca = vc->code[a], cb = vc->code[b], cc = vc->code[c];
+    if (ca & cb & cc & ~VCACHE_CLIP) continue;
+    if ((ca | cb | cc) & VCACHE_CLIP) {
+      cull_and_draw_triangle(render, in + a, in + b, in + c);
+      continue;
+    }
+    const wg_point_t *pa = &vc->screen[a].vPosH, *pb = &vc->screen[b].vPosH, *pc = &vc->screen[c].vPosH;
+    float area = (pb->x - pa->x) * (pc->y - pa->y) - (pc->x - pa->x) * (pb->y - pa->y);
+    if (cull_area(render, area)) continue;
+    bin_triangle(render, vc->screen + a, vc->screen + b, vc->screen + c);
   }
 }
 
-static void draw_trapezoid(
+ALWAYS_INLINE uint64_t draw_scanline(
   const wg_render_t *render,
-  const wg_trapezoid_t *t
+  const wg_tri_setup_t *setup,
+  const wg_scanline_t *s,
+  const wg_rect_t *rect,
+  const uint32_t mask
+);
+
+ALWAYS_INLINE uint64_t draw_trapezoid(
+  const wg_render_t *render,
+  const wg_tri_setup_t *setup,
+  const wg_trapezoid_t *t,
+  const wg_rect_t *rect,
+  const uint32_t mask
 ) {
-  wg_vertex_t l, r, step, start;
   wg_scanline_t scanline;
-  float y_st = ceilf(t->top), y_ed = ceilf(t->bottom);
+  uint64_t touched = 0;
+  int y_st = (int)ceilf(t->top), y_ed = (int)ceilf(t->bottom);
   float ylength = t->bottom - t->top;
-  float yratio = (y_st - t->top) / ylength;
-  for (int y = (int)y_st; y < y_ed; y ++, yratio = (y - t->top) / ylength) {
-    if (y < 0) continue;
-    if (y >= render->height) break;
-    vertex_interp(&l, &(t->v1), &(t->v2), yratio);
-    vertex_interp(&r, &(t->v3), &(t->v4), yratio);
-    vertex_step(&step, &l, &r);
-    float x = ceilf(l.vPosH.x), w = ceilf(r.vPosH.x) - ceilf(l.vPosH.x);
-    float _r = (x-l.vPosH.x) / (r.vPosH.x-l.vPosH.x);
-    vertex_interp(&start, &l, &r, _r);
-    scanline = (wg_scanline_t){start, step, (int)x, (int)y, (int)w};
-    draw_scanline(render, &scanline);
+  if (y_st < rect->y0) y_st = rect->y0;
+  if (y_ed > rect->y1) y_ed = rect->y1;
+  for (int y = y_st; y < y_ed; y ++) {
+    float yratio = (y - t->top) / ylength;
+    float l = ceilf(lerp(t->p1.x, t->p2.x, yratio));
+    float r = ceilf(lerp(t->p3.x, t->p4.x, yratio));
+    scanline = (wg_scanline_t){(int)l, y, (int)(r - l)};
+    touched |= draw_scanline(render, setup, &scanline, rect, mask);
   }
+  return touched;
 }
 
-static void draw_scanline(
+/**
+ * @description: Draw a scanline block by block. Segments behind the
+ *  hierarchical z are skipped, segments in front of it skip the depth test.
+ */
+ALWAYS_INLINE uint64_t draw_scanline(
   const wg_render_t *render,
-  const wg_scanline_t *s
+  const wg_tri_setup_t *setup,
+  const wg_scanline_t *s,
+  const wg_rect_t *rect,
+  const uint32_t mask
 ) {
-  int x = s->x, y = s->y;
-  wg_vertex_t v = s->v;
-  wg_gbuff_t *geom;
-  uint8_t *stencil;
-  float *depth;
-  for (int i = 0; i < s->w; i ++) {
-    if (x < 0) {
-      vertex_add(&v, &(s->step));
-      x ++;
+  const wg_hiz_t *hiz = render->hiz;
+  int x = s->x, y = s->y, x_ed = s->x + s->w;
+  float val[N_VARYING_SLOT];
+  uint64_t touched = 0;
+  if (x < rect->x0) x = rect->x0;
+  if (x_ed > rect->x1) x_ed = rect->x1;
+  while (x < x_ed) {
+    int seg_ed = (x / HIZ_BLOCK_SIZE + 1) * HIZ_BLOCK_SIZE;
+    if (seg_ed > x_ed) seg_ed = x_ed;
+    int b = hiz_block(hiz, x, y);
+    setup_eval(setup, (float)x, (float)y, val, mask);
+    float z_ed = val[VS_Z] + setup->a[VS_Z] * (seg_ed - 1 - x);
+    if (fminf(val[VS_Z], z_ed) >= hiz->blockMax[b]) {
+      x = seg_ed;
       continue;
     }
-    if (x >= render->width) {
-      break;
-    }
-    float z = v.vPosH.z, w = 1. / v.rhw;
-    depth = render->zBuffer + map_coord_to_offset(render, x, y);
-    if (z < *depth) {
-      stencil = render->stencil + map_coord_to_offset(render, x, y);
-      *depth = z;
-      *stencil = 1;
-      geom = render->gBuffer + map_coord_to_offset(render, x, y);
-      geom->vPosH = v4f_mul(v.vPosH, w);
-      geom->vPos = v4f_mul(v.vPos, w);
-      geom->normal = v4f_mul(v.normal, w);
-      geom->tc = (wg_txcoord_t){v.tc.x * w, v.tc.y * w};
-      geom->vColor = (wg_color_t){v.vColor.r * w, v.vColor.g * w, v.vColor.b * w};
-      geom->color = (wg_color_t){0., 0., 0.};
-      geom->diffuseColor = (wg_color_t){0., 0., 0.};
-      geom->specularColorAdder = (wg_color_t){0., 0., 0.};
+    int pass = fmaxf(val[VS_Z], z_ed) < hiz->blockMin[b];
+    int written = 0;
+    float *depth = render->zBuffer + map_coord_to_offset(render, x, y);
+    for (; x < seg_ed; x ++, depth ++) {
+      if (pass || val[VS_Z] < *depth) {
+        write_fragment(render, setup, x, y, val, mask);
+        written = 1;
+      }
+      setup_step_x(setup, val, mask);
     }
-    vertex_add(&v, &(s->step));
-    x ++;
+    if (written) touched |= hiz_touch_bit(rect, seg_ed - 1, y);
+  }
+  return touched;
+}
+
+ALWAYS_INLINE uint64_t raster_triangle_scanline(
+  const wg_render_t *render,
+  const wg_tri_setup_t *setup,
+  const wg_rect_t *rect,
+  const uint32_t mask
+) {
+  wg_trapezoid_t t1, t2;
+  uint64_t touched;
+  int n_trape = split_trapezoid(&setup->p[0], &setup->p[1], &setup->p[2], &t1, &t2);
+  touched = draw_trapezoid(render, setup, &t1, rect, mask);
+  if (n_trape > 1) {
+    touched |= draw_trapezoid(render, setup, &t2, rect, mask);
   }
-}
\ No newline at end of file
+  return touched;
+}
+
+/* Scanline rasterizer specialized for every combination of live varyings */
+#define SCANLINE_VARIANT(m) \
+  static uint64_t raster_triangle_scanline_##m(const wg_render_t *render, const wg_tri_setup_t *setup, const wg_rect_t *rect) { \
+    return raster_triangle_scanline(render, setup, rect, m); \
+  }
+FOR_EACH_VARYING_MASK(SCANLINE_VARIANT)
+#undef SCANLINE_VARIANT
+
+#define SCANLINE_ENTRY(m) [m] = &raster_triangle_scanline_##m,
+static wg_raster_fn_t* const scanline_variant[VARYING_ID + 1] = { FOR_EACH_VARYING_MASK(SCANLINE_ENTRY) };
+#undef SCANLINE_ENTRY
+
+/**
+ * @description: Rasterize the part of a set up triangle that lies in rect.
+ * @param {render}
+ * @param {setup} Triangle setup, see setup_triangle.
+ * @param {rect} Tile rect. Pixels outside of rect are left untouched.
+ * @return: Mask of the hierarchical z blocks that have been written, see hiz_touch_bit.
+ */
+uint64_t raster_triangle(
+  const wg_render_t *render,
+  const wg_tri_setup_t *setup,
+  const wg_rect_t *rect
+) {
+  if (render->rasterMode == RASTER_HALFSPACE) {
+    return raster_triangle_halfspace(render, setup, rect);
+  }
+  return (*scanline_variant[raster_mask(render, setup)])(render, setup, rect);
+}
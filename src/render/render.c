@@ -1,50 +1,137 @@
 #include "render.h"
+#include "raster.h"
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
 
+/* The render of get_render */
 static wg_render_t *render = NULL;
+static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static void try_init_render() {
-  if (render == NULL) {
-    render = (wg_render_t *)malloc(sizeof(wg_render_t));
-    render->fshaderName = "default";
-    render->stencil = NULL;
-    render->frameBuffer = NULL;
-    render->zBuffer = NULL;
-    render->gBuffer = NULL;
-    wg_transform_t *t = &(render->transform);
-    t->world = NULL;
-    t->camera = NULL;
-    t->projection = NULL;
-    t->transform = NULL;
-    t->transform_p = NULL;
+/**
+ * @description: Create an independent render context. Contexts share nothing
+ *  but the shader & pipeline registries, so each one may be driven by its own
+ *  thread. Call set_up_render before drawing.
+ *  Fields not set below start zeroed: no buffers, lights, shadow map or
+ *  material tables.
+ * @return: Pointer to the new render.
+ */
+wg_render_t* create_render() {
+  wg_render_t *render = (wg_render_t *)calloc(1, sizeof(wg_render_t));
+  Assert(render != NULL, "Cannot allocate a render context.");
+  render->fshaderName = "default";
+  render->pipeline = -1;
+  render->renderMode = VERTEX_COLOR;
+  render->rasterMode = RASTER_SCANLINE;
+  render->sampleMode = BILINEAR;
+  render->colorFormat = COLOR_R11G11B10;
+  render->gbufferMode = GBUFFER_ATTRIBUTES;
+  render->cullMode = CULL_NONE;
+  render->frontFace = FRONT_CCW;
+  render->material = (wg_material_t){0., 1., 0.};
+  return render;
+}
+
+/**
+ * @description: Free a render context and everything it owns. Render targets,
+ *  shadow maps & textures made by the caller are left alone.
+ */
+void destroy_render(wg_render_t *r) {
+  if (r->defaultTarget != NULL) destroy_render_target(r->defaultTarget);
+  destroy_pool(r->pool);
+  if (r->vcache != NULL) {
+    free(r->vcache->in);
+    free(r->vcache->screen);
+    free(r->vcache->code);
+    free(r->vcache);
   }
+  free(r->lights);
+  free(r->viewLights);
+  free(r->tileLights);
+  free(r->tileLightCount);
+  free(r->transform.transform);
+  free(r->transform.transform_p);
+  pthread_mutex_lock(&render_lock);
+  if (r == render) render = NULL;
+  pthread_mutex_unlock(&render_lock);
+  free(r);
 }
 
+/**
+ * @description: The process wide default render, created on first use.
+ */
 wg_render_t* get_render() {
-  try_init_render();
+  pthread_mutex_lock(&render_lock);
+  if (render == NULL) render = create_render();
+  pthread_mutex_unlock(&render_lock);
   return render;
 }
 
+/**
+ * @description: Give the render its default target & worker pool. Calling it
+ *  again only resizes, see resize_render. The default target has no
+ *  ATTACH_VISIBILITY plane, GBUFFER_VISIBILITY draws into a target with one.
+ * @param {width, height} Frame size in pixels.
+ */
 void set_up_render(wg_render_t *render, int width, int height) {
-  render->width = width;
-  render->height = height;
-  render->stencil = (uint8_t*)malloc(width * height * sizeof(uint8_t));
-  render->frameBuffer = (uint8_t*)malloc(width * height * sizeof(uint32_t));
-  render->zBuffer = (float*)malloc(width * height * sizeof(float));
-  render->gBuffer = (wg_gbuff_t*)malloc(width * height * sizeof(wg_gbuff_t));
+  if (render->defaultTarget != NULL) {
+    resize_render(render, width, height);
+    return;
+  }
+  render->defaultTarget = create_render_target(width, height, ATTACH_COLOR | ATTACH_DEPTH | ATTACH_GBUFFER);
+  if (render->pool == NULL) render->pool = create_pool(render->nThreads);
   wg_transform_t *t = &(render->transform);
   t->transform = (wg_mat44f*)malloc(sizeof(wg_mat44f));
   t->transform_p = (wg_mat44f*)malloc(sizeof(wg_mat44f));
-  t->w = width;
-  t->h = height;
+  bind_render_target(render, NULL);
+}
+
+/**
+ * @description: Change the frame size. The buffers of the default target are
+ *  reused unless they have to grow, their contents are lost. Other targets
+ *  keep their size.
+ * @param {width, height} New frame size in pixels.
+ */
+void resize_render(wg_render_t *render, int width, int height) {
+  resize_render_target(render->defaultTarget, width, height);
+  if (render->target == render->defaultTarget) bind_render_target(render, NULL);
 }
 
+/**
+ * @description: Bytes of memory owned by the render: its default target, light
+ *  lists, vertex storage & matrices. Worker threads are not counted.
+ */
+size_t render_footprint(const wg_render_t *render) {
+  size_t size = sizeof(wg_render_t);
+  if (render->defaultTarget != NULL) size += render_target_footprint(render->defaultTarget);
+  if (render->transform.transform != NULL) size += 2 * sizeof(wg_mat44f);
+  size += 2 * render->capLights * sizeof(wg_light_t);
+  size += render->lightTiles * (render->capLights + 1) * sizeof(uint32_t);
+  if (render->vcache != NULL) {
+    size += sizeof(wg_vcache_t) + render->vcache->cap * (2 * sizeof(wg_vertex_t) + sizeof(uint8_t));
+  }
+  return size;
+}
+
+/**
+ * @description: Start a new frame. zBuffer & stencil are cleared lazily tile by
+ *  tile, they read as cleared after the next flush_render. frameBuffer is left
+ *  alone, shade_on_buffer writes all of it.
+ */
 void clear_render(wg_render_t *render) {
-  int len = render->width * render->height;
-  for (int i = 0; i < len; i ++) render->stencil[i] = 0;
-  for (int i = 0; i < len * 4; i ++) render->frameBuffer[i] = 0;
-  for (int i = 0; i < len; i ++) render->zBuffer[i] = 1.;
+  reset_binner(render->binner);
+  clear_tiles(render);
+}
+
+/**
+ * @description: Restart the worker pool with another number of threads.
+ * @param {nThreads} Threads working on rasterization & shading, the caller
+ *  included. 0 means one per CPU.
+ */
+void set_render_threads(wg_render_t *render, int nThreads) {
+  render->nThreads = nThreads;
+  destroy_pool(render->pool);
+  render->pool = create_pool(nThreads);
 }
 
 void set_light(wg_render_t *render, wg_light_t light) {
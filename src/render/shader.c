@@ -1,26 +1,48 @@
 #include "render.h"
+#include "pipeline.h"
+#include "raster.h"
 #include "common.h"
 #include "texture.h"
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <pthread.h>
 
-// TODO: a fragment shader register
-//   LIST: shader name -> shader function pointer
-//   REGISTER (shader name, shader function pointer)
+/* Fragment shader & pipeline registries, shared by every render context.
+   Registering takes the write lock, lookups the read lock, so contexts may
+   look shaders up from several threads while others are registered. */
+static pthread_rwlock_t reg_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 #define MAX_SHADER_NUM 256
+#define MAX_PIPELINE_NUM 64
+
+/* Signature of a registered fragment shader */
+enum SHADER_KIND {
+  SHADER_PIXEL = 0,         // wg_fshader_t
+  SHADER_BATCH              // wg_fshader_batch_t
+};
 
 typedef struct {
   const char* name[MAX_SHADER_NUM];
   const void* value[MAX_SHADER_NUM];
+  enum SHADER_KIND kind[MAX_SHADER_NUM];
   size_t size;
 } wg_register_t;
 
-wg_register_t frag_shader_reg;
+static wg_register_t frag_shader_reg;
+
+static struct {
+  const char* name[MAX_PIPELINE_NUM];
+  wg_pipeline_fn_t* fn[MAX_PIPELINE_NUM];
+  int size;
+} pipeline_reg;
+
+static wg_pipeline_fn_t* get_pipeline_fn(wg_pipeline_t handle);
 
 wg_fshader_t* get_frag_shader(const char* name);
 
+wg_fshader_batch_t* get_frag_shader_batch(const char* name);
+
 void shade_vertex(
   const wg_render_t *render, 
   wg_vertex_t *v, size_t size, 
@@ -38,73 +60,277 @@ void default_vs(const wg_render_t *render, wg_vertex_t *v) {
   vertex_init_rhw(v);
 }
 
+/**
+ * @description: Rebuild the varyings of pixel i from the planes of its
+ *  visible triangle, see GBUFFER_VISIBILITY.
+ */
+void rebuild_fragment_varyings(const wg_render_t *render, int i, wg_gbuff_t *frag) {
+  const wg_tri_setup_t *setup = render->binner->tri + render->gBuffer.primId[i];
+  float val[N_VARYING_SLOT];
+  setup_eval(setup, (float)(i % render->width), (float)(i / render->width), val, setup->varyings);
+  float w = 1.f / val[VS_RHW];
+  frag->materialId = setup->materialId;
+  if (setup->varyings & VARYING_NORMAL) {
+    frag->normal = (wg_point_t){ {{val[VS_NORMAL], val[VS_NORMAL + 1], val[VS_NORMAL + 2], 1.f}} };
+    normalize_vec4f(&frag->normal);
+  }
+  if (setup->varyings & VARYING_TC) {
+    frag->tc = (wg_txcoord_t){val[VS_TC] * w, val[VS_TC + 1] * w};
+    frag->footprint = setup_footprint(setup, i % render->width, i / render->width);
+  }
+  if (setup->varyings & VARYING_COLOR) {
+    frag->vColor = (wg_color_t){val[VS_COLOR] * w, val[VS_COLOR + 1] * w, val[VS_COLOR + 2] * w};
+  }
+}
+
+typedef struct wg_shade_job wg_shade_job_t;
+
+/* Shade pixel (x0 + k, y) for every bit k set in mask */
+typedef void (wg_shade_row_fn_t)(const wg_shade_job_t *sj, int x0, int y, uint64_t mask);
+
+struct wg_shade_job {
+  const wg_render_t *render;
+  wg_shade_row_fn_t *row;
+  wg_fshader_t *fshader;
+  wg_fshader_batch_t *fshaderBatch;
+  wg_pipeline_fn_t *pipeline;
+  wg_sampler_t *sampler;
+  wg_shade_ctx_t ctx;
+};
+
+static void shade_row_vertex_color(const wg_shade_job_t *sj, int x0, int y, uint64_t mask) {
+  const wg_render_t *render = sj->render;
+  const wg_gbuffer_t *gb = &render->gBuffer;
+  for (uint64_t m = mask; m; m &= m - 1) {
+    int i = y * render->width + x0 + __builtin_ctzll(m);
+    if (render->gbufferMode == GBUFFER_VISIBILITY) {
+      wg_gbuff_t frag;
+      rebuild_fragment_varyings(render, i, &frag);
+      gb->color[i] = pack_color(render->colorFormat, frag.vColor);
+    } else {
+      // Both planes share colorFormat, so the packed value is copied as is
+      gb->color[i] = gb->vColor[i];
+    }
+  }
+}
+
+static void shade_row_shaded(const wg_shade_job_t *sj, int x0, int y, uint64_t mask) {
+  const wg_render_t *render = sj->render;
+  for (uint64_t m = mask; m; m &= m - 1) {
+    int i = y * render->width + x0 + __builtin_ctzll(m);
+    wg_gbuff_t frag;
+    load_fragment(render, &sj->ctx, i, &frag);
+    // sample texture
+    frag.diffuseColor = (*sj->sampler)(frag.texture, frag.tc.x, frag.tc.y, frag.footprint);
+    // shade fragment
+    (*sj->fshader)(render, &frag);
+    store_fragment_color(render, i, frag.color);
+  }
+}
+
+static void shade_row_pipeline(const wg_shade_job_t *sj, int x0, int y, uint64_t mask) {
+  (*sj->pipeline)(sj->render, &sj->ctx, x0, y, mask);
+}
+
+static void batch_set_lane(wg_frag_batch_t *batch, int k, const wg_gbuff_t *frag) {
+  batch->vPos.x[k] = frag->vPos.x;
+  batch->vPos.y[k] = frag->vPos.y;
+  batch->vPos.z[k] = frag->vPos.z;
+  batch->normal.x[k] = frag->normal.x;
+  batch->normal.y[k] = frag->normal.y;
+  batch->normal.z[k] = frag->normal.z;
+  batch->u[k] = frag->tc.x;
+  batch->v[k] = frag->tc.y;
+  batch->footprint[k] = frag->footprint;
+  batch->vColor.r[k] = frag->vColor.r;
+  batch->vColor.g[k] = frag->vColor.g;
+  batch->vColor.b[k] = frag->vColor.b;
+  batch->material[k] = frag->material;
+  batch->diffuseColor.r[k] = frag->diffuseColor.r;
+  batch->diffuseColor.g[k] = frag->diffuseColor.g;
+  batch->diffuseColor.b[k] = frag->diffuseColor.b;
+}
+
+/**
+ * @description: Like shade_row_shaded, but gathers FRAG_BATCH pixels into one
+ *  wg_frag_batch_t, and calls the batch shader once per non-empty batch.
+ */
+static void shade_row_batch(const wg_shade_job_t *sj, int x0, int y, uint64_t mask) {
+  const wg_render_t *render = sj->render;
+  for (int b = 0; b < TILE_SIZE; b += FRAG_BATCH) {
+    uint32_t lanes = (uint32_t)(mask >> b) & ((1u << FRAG_BATCH) - 1);
+    if (lanes == 0) continue;
+    int row = y * render->width + x0 + b;
+
+    wg_frag_batch_t batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.mask = lanes;
+    batch.x = x0 + b;
+    batch.y = y;
+    tile_lights(render, (y / TILE_SIZE) * render->binner->tilesX + x0 / TILE_SIZE, &batch.lights, &batch.nLights);
+    for (uint32_t m = lanes; m; m &= m - 1) {
+      int k = __builtin_ctz(m);
+      wg_gbuff_t frag;
+      load_fragment(render, &sj->ctx, row + k, &frag);
+      frag.diffuseColor = (*sj->sampler)(frag.texture, frag.tc.x, frag.tc.y, frag.footprint);
+      batch_set_lane(&batch, k, &frag);
+    }
+    (*sj->fshaderBatch)(render, &batch);
+    for (uint32_t m = lanes; m; m &= m - 1) {
+      int k = __builtin_ctz(m);
+      wg_color_t c = {batch.color.r[k], batch.color.g[k], batch.color.b[k]};
+      store_fragment_color(render, row + k, c);
+    }
+  }
+}
+
+/**
+ * @description: Tile job of the shading pass, only rows with covered pixels are visited.
+ */
+static void shade_tile(void *arg, uint32_t tile) {
+  const wg_shade_job_t *sj = (const wg_shade_job_t*)arg;
+  const wg_binner_t *binner = sj->render->binner;
+  const uint64_t *coverage = binner->coverage + tile * TILE_SIZE;
+  int x0 = (tile % binner->tilesX) * TILE_SIZE, y0 = (tile / binner->tilesX) * TILE_SIZE;
+  if (sj->render->renderMode == SHADED && sj->render->nLights > 0) {
+    cull_tile_lights(sj->render, &sj->ctx.invProj, tile);
+  }
+  for (int r = 0; r < TILE_SIZE; r ++) {
+    if (coverage[r]) (*sj->row)(sj, x0, y0 + r, coverage[r]);
+  }
+}
+
+/**
+ * @description: Shade every covered pixel into gBuffer.color, one tile per job
+ *  of the render's worker pool. Fragment shaders are called concurrently.
+ */
 void shade_fragment(wg_render_t *render) {
-  int w = render->width, h = render->height, len = w * h;
+  uint32_t nTiles = render->binner->tilesX * render->binner->tilesY;
+  wg_shade_job_t job;
+  job.render = render;
+  flush_render(render);
+  Assert(render->gBuffer.color != NULL, "The bound render target has no G-buffer.");
   if (render->renderMode == FRAMEWORK) {
     TODO();
   } else if (render->renderMode == VERTEX_COLOR) {
-    for (int i = 0; i < len; i ++) {
-      uint8_t *stencil = render->stencil + i;
-      wg_gbuff_t *gbuff = render->gBuffer + i;
-      gbuff->color = gbuff->vColor;
-    }
+    job.row = shade_row_vertex_color;
+    run_jobs(render->pool, shade_tile, &job, nTiles);
   } else if (render->renderMode == SHADED) {
-    Assert(render->texture != NULL, "Texture cannot be NULL in SHADE mode.");
-    wg_color_t (*t_sampler)(const wg_texture_t *tex, float x, float y) = load_sampler(render->sampleMode);
-    wg_fshader_t* fshader = get_frag_shader(render->fshaderName);
-    Assert(fshader != NULL, "Shader %s doesn't exist.", render->fshaderName);
-    for (int i = 0; i < len; i ++) {
-      uint8_t *stencil = render->stencil + i;
-      wg_gbuff_t *gbuff = render->gBuffer + i;
-      if (*stencil > 0) {
-        // sample texture
-        gbuff->diffuseColor = (*t_sampler)(render->texture, gbuff->tc.x, gbuff->tc.y);
-        // shade fragment
-        (*fshader)(render, gbuff);
+    if (render->nMaterials > 0) {
+      Assert(render->nMaterials <= MAX_MATERIALS, "Material num out of bounds. Current MAX %d.", MAX_MATERIALS);
+      for (uint32_t m = 0; m < render->nMaterials; m ++) {
+        Assert(render->textures[m] != NULL, "Texture of material %u cannot be NULL in SHADE mode.", m);
       }
+    } else {
+      Assert(render->texture != NULL, "Texture cannot be NULL in SHADE mode.");
+    }
+    Assert(matinv(render->transform.projection, &job.ctx.invProj), "Projection matrix is singular.");
+    if (render->shadow != NULL) update_shadow_map(render, render->shadow);
+    update_view_lights(render);
+    reserve_tile_lights(render, nTiles);
+    if (render->pipeline >= 0) {
+      job.pipeline = get_pipeline_fn(render->pipeline);
+      job.row = shade_row_pipeline;
+    } else {
+      job.sampler = load_sampler(render->sampleMode);
+      job.fshader = get_frag_shader(render->fshaderName);
+      job.fshaderBatch = get_frag_shader_batch(render->fshaderName);
+      Assert(job.fshader != NULL || job.fshaderBatch != NULL, "Shader %s doesn't exist.", render->fshaderName);
+      job.row = job.fshader ? shade_row_shaded : shade_row_batch;
     }
+    run_jobs(render->pool, shade_tile, &job, nTiles);
   }
 }
 
-static uint32_t rgb_to_uint(const wg_color_t *t) {
-  int c[3];
-  uint32_t res = 0;
-  c[0] = t->r * 255;
-  c[1] = t->g * 255;
-  c[2] = t->b * 255;
-  for (int i = 0; i < 3; i ++) {
-    c[i] = c[i] > 255 ? 255 : c[i];
-    c[i] = c[i] < 0 ? 0 : c[i];
-    res += c[i] << (i << 3);
+/**
+ * @description: Tile job of shade_on_buffer. Rows without any covered pixel,
+ *  thus whole empty tiles, are cleared in bulk. With SSE2 the covered pixels
+ *  are unpacked & encoded 4 at a time.
+ */
+static void resolve_tile(void *arg, uint32_t tile) {
+  const wg_render_t *render = (const wg_render_t*)arg;
+  const wg_binner_t *binner = render->binner;
+  const uint64_t *coverage = binner->coverage + tile * TILE_SIZE;
+  int x0 = (tile % binner->tilesX) * TILE_SIZE, y0 = (tile / binner->tilesX) * TILE_SIZE;
+  int w = render->width - x0 < TILE_SIZE ? render->width - x0 : TILE_SIZE;
+  int h = render->height - y0 < TILE_SIZE ? render->height - y0 : TILE_SIZE;
+  for (int r = 0; r < h; r ++) {
+    const uint32_t *color = render->gBuffer.color + (y0 + r) * render->width + x0;
+    uint32_t *fbuff = (uint32_t*)render->frameBuffer + (y0 + r) * render->width + x0;
+    uint64_t m = coverage[r];
+    memset(fbuff, 0, w * sizeof(uint32_t));
+#ifdef __SSE2__
+    // 4 pixels per iteration, the lanes not covered are masked to 0
+    const __m128i bit = _mm_setr_epi32(1, 2, 4, 8);
+    int k = 0;
+    for (; k + 4 <= w; k += 4) {
+      uint32_t lanes = (uint32_t)(m >> k) & 15;
+      if (lanes == 0) continue;
+      __m128 cr, cg, cb;
+      unpack_color_ps(render->colorFormat, _mm_loadu_si128((const __m128i*)(color + k)), &cr, &cg, &cb);
+      __m128i keep = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(lanes), bit), bit);
+      _mm_storeu_si128((__m128i*)(fbuff + k), _mm_and_si128(gamma_encode_ps(cr, cg, cb), keep));
+    }
+    // The last pixels of a row narrower than a multiple of 4
+    m = k < TILE_SIZE ? m & ~0ull << k : 0;
+#endif
+    for (; m; m &= m - 1) {
+      int x = __builtin_ctzll(m);
+      wg_color_t c = unpack_color(render->colorFormat, color[x]);
+      fbuff[x] = gamma_encode_color(&c);
+    }
   }
-  return res;
 }
 
+/**
+ * @description: Gamma correct gBuffer.color into frameBuffer on the worker pool,
+ *  through the table of gamma_encode_color.
+ */
 void shade_on_buffer(wg_render_t *render) {
-  int w = render->width, h = render->height, len = w * h;
-  for (int i = 0; i < len; i ++) {
-    uint8_t *stencil = render->stencil + i;
-    wg_gbuff_t *gbuff = render->gBuffer + i;
-    uint32_t *fbuff = (uint32_t*)(render->frameBuffer + i * 4);
-    if (*stencil > 0) {
-      wg_color_t c = gamma_trans(&gbuff->color, GAMMA_INV);
-      *fbuff = rgb_to_uint(&c);
-    } else {
-      *fbuff = 0;
-    }
-  }
+  Assert(render->frameBuffer != NULL, "The bound render target has no color attachment.");
+  run_jobs(render->pool, resolve_tile, render, render->binner->tilesX * render->binner->tilesY);
 }
 
 static void default_fshader(const wg_render_t* render, wg_gbuff_t* gbuff) {
   gbuff->color = gbuff->diffuseColor;
 }
 
+static int find_frag_shader(const char* name) {
+  for (int i = 0; i < frag_shader_reg.size; i ++) {
+    if (strcmp(name, frag_shader_reg.name[i]) == 0) return i;
+  }
+  return -1;
+}
+
+/* Append a shader to the register, the write lock is held by the caller */
+static void add_shader(const char* name, const void* shader, enum SHADER_KIND kind) {
+  Assert(frag_shader_reg.size < MAX_SHADER_NUM, "Shader num out of bounds. Current MAX %d.", MAX_SHADER_NUM);
+  Assert(find_frag_shader(name) < 0, "Shader name MUST be unique! Name %s has been taken.", name);
+  frag_shader_reg.name[frag_shader_reg.size] = name;
+  frag_shader_reg.value[frag_shader_reg.size] = shader;
+  frag_shader_reg.kind[frag_shader_reg.size] = kind;
+  frag_shader_reg.size ++;
+}
+
 /**
- * @description: Initialize fragment shader register.
+ * @description: Initialize fragment shader register. Drops every shader &
+ *  pipeline registered so far, so pipeline handles got before are invalid.
+ *  Call it before any render context shades. Concurrent calls are safe,
+ *  each leaves only the default shader.
  */
 void init_frag_shader_reg() {
+  pthread_rwlock_wrlock(&reg_lock);
   frag_shader_reg.size = 0;
-  register_frag_shader("default", &default_fshader);
+  pipeline_reg.size = 0;
+  add_shader("default", (const void*)&default_fshader, SHADER_PIXEL);
+  pthread_rwlock_unlock(&reg_lock);
+}
+
+static void register_shader(const char* name, const void* shader, enum SHADER_KIND kind) {
+  pthread_rwlock_wrlock(&reg_lock);
+  add_shader(name, shader, kind);
+  pthread_rwlock_unlock(&reg_lock);
+  Log("Fragment shader %s has been successfully registed.", name);
 }
 
 /**
@@ -113,25 +339,91 @@ void init_frag_shader_reg() {
  * @param {wg_fshader_t* shader} The shader function.
  */
 void register_frag_shader(const char* name, wg_fshader_t* shader) {
-  Assert(frag_shader_reg.size < MAX_SHADER_NUM, "Shader num out of bounds. Current MAX %d.", MAX_SHADER_NUM);
-  wg_fshader_t* t = get_frag_shader(name);
-  Assert(t == NULL, "Shader name MUST be unique! Name %s has been taken.", name);
-  frag_shader_reg.name[frag_shader_reg.size] = name;
-  frag_shader_reg.value[frag_shader_reg.size] = (void*)shader;
-  frag_shader_reg.size ++;
-  Log("Fragment shader %s has been successfully registed.", name);
+  register_shader(name, (const void*)shader, SHADER_PIXEL);
+}
+
+/**
+ * @description: Register a user-defined fragment shader working on
+ *  wg_frag_batch_t. Shares the name space with register_frag_shader.
+ * @param {const char* name} The name of shader. MUST BE UNIQUE.
+ * @param {wg_fshader_batch_t* shader} The shader function.
+ */
+void register_frag_shader_batch(const char* name, wg_fshader_batch_t* shader) {
+  register_shader(name, (const void*)shader, SHADER_BATCH);
 }
 
 /**
  * @description: Get a user-defined fragment shader.
  * @param {const char* name} The name of shader. 
- * @return: {wg_fshader_t*} The shader function required.
+ * @return: {wg_fshader_t*} The shader function required, NULL if there is no per pixel shader of that name.
  */
 wg_fshader_t* get_frag_shader(const char* name) {
-  for (int i = 0; i < frag_shader_reg.size; i ++) {
-    if (strcmp(name, frag_shader_reg.name[i]) == 0) {
-      return (wg_fshader_t*)frag_shader_reg.value[i];
-    }
+  wg_fshader_t *shader = NULL;
+  pthread_rwlock_rdlock(&reg_lock);
+  int i = find_frag_shader(name);
+  if (i >= 0 && frag_shader_reg.kind[i] == SHADER_PIXEL) shader = (wg_fshader_t*)frag_shader_reg.value[i];
+  pthread_rwlock_unlock(&reg_lock);
+  return shader;
+}
+
+/**
+ * @description: Get a user-defined batch fragment shader.
+ * @param {const char* name} The name of shader.
+ * @return: {wg_fshader_batch_t*} The shader function required, NULL if there is no batch shader of that name.
+ */
+wg_fshader_batch_t* get_frag_shader_batch(const char* name) {
+  wg_fshader_batch_t *shader = NULL;
+  pthread_rwlock_rdlock(&reg_lock);
+  int i = find_frag_shader(name);
+  if (i >= 0 && frag_shader_reg.kind[i] == SHADER_BATCH) shader = (wg_fshader_batch_t*)frag_shader_reg.value[i];
+  pthread_rwlock_unlock(&reg_lock);
+  return shader;
+}
+
+static int find_pipeline(const char* name) {
+  for (int i = 0; i < pipeline_reg.size; i ++) {
+    if (strcmp(name, pipeline_reg.name[i]) == 0) return i;
   }
-  return (wg_fshader_t*)NULL;
-}
\ No newline at end of file
+  return -1;
+}
+
+/**
+ * @description: Register a shading pipeline defined by DEFINE_PIPELINE.
+ *  Pipelines stay registered until the next init_frag_shader_reg.
+ * @param {const char* name} The name of pipeline. MUST BE UNIQUE.
+ * @param {wg_pipeline_fn_t* fn} The pipeline.
+ * @return: {wg_pipeline_t} Handle to put into render->pipeline.
+ */
+wg_pipeline_t register_pipeline(const char* name, wg_pipeline_fn_t* fn) {
+  pthread_rwlock_wrlock(&reg_lock);
+  Assert(find_pipeline(name) < 0, "Pipeline name MUST be unique! Name %s has been taken.", name);
+  Assert(pipeline_reg.size < MAX_PIPELINE_NUM, "Pipeline num out of bounds. Current MAX %d.", MAX_PIPELINE_NUM);
+  wg_pipeline_t handle = pipeline_reg.size;
+  pipeline_reg.name[handle] = name;
+  pipeline_reg.fn[handle] = fn;
+  pipeline_reg.size ++;
+  pthread_rwlock_unlock(&reg_lock);
+  Log("Pipeline %s has been successfully registed.", name);
+  return handle;
+}
+
+/**
+ * @description: Look a pipeline up by name, once at setup.
+ * @return: {wg_pipeline_t} Its handle, -1 if there is none.
+ */
+wg_pipeline_t get_pipeline(const char* name) {
+  wg_pipeline_t handle;
+  pthread_rwlock_rdlock(&reg_lock);
+  handle = find_pipeline(name);
+  pthread_rwlock_unlock(&reg_lock);
+  return handle;
+}
+
+static wg_pipeline_fn_t* get_pipeline_fn(wg_pipeline_t handle) {
+  wg_pipeline_fn_t *fn;
+  pthread_rwlock_rdlock(&reg_lock);
+  Assert(handle >= 0 && handle < pipeline_reg.size, "Pipeline handle %d doesn't exist.", handle);
+  fn = pipeline_reg.fn[handle];
+  pthread_rwlock_unlock(&reg_lock);
+  return fn;
+}
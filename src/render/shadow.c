@@ -0,0 +1,105 @@
+#include "render.h"
+#include "raster.h"
+#include <stdlib.h>
+#include <math.h>
+
+/**
+ * @description: Create a square shadow map. view & projection are left to the caller.
+ * @param {size} Width & height in texels.
+ * @return: Pointer to the new shadow map.
+ */
+wg_shadow_map_t* create_shadow_map(uint32_t size) {
+  wg_shadow_map_t *shadow = (wg_shadow_map_t*)malloc(sizeof(wg_shadow_map_t));
+  shadow->size = size;
+  shadow->target = create_render_target(size, size, ATTACH_DEPTH);
+  get_identical_mat(&shadow->view);
+  get_identical_mat(&shadow->projection);
+  get_identical_mat(&shadow->toLight);
+  shadow->bias = 0.005f;
+  shadow->pcf = 1;
+  return shadow;
+}
+
+/**
+ * @description: Free a shadow map. It must not be bound to a render anymore.
+ */
+void destroy_shadow_map(wg_shadow_map_t *shadow) {
+  destroy_render_target(shadow->target);
+  free(shadow);
+}
+
+/**
+ * @description: Redirect the next draws into the shadow map. They are seen
+ *  through shadow->view & shadow->projection and only write depth. The world
+ *  matrix stays the one of the render.
+ */
+void begin_shadow_pass(wg_render_t *render, wg_shadow_map_t *shadow) {
+  wg_transform_t *t = &render->transform;
+  shadow->savedTarget = render->target;
+  shadow->savedTransform = *t;
+  shadow->savedMat = *t->transform;
+  shadow->savedMatP = *t->transform_p;
+  shadow->savedMode = render->gbufferMode;
+
+  bind_render_target(render, shadow->target);
+  render->gbufferMode = GBUFFER_DEPTH;
+  t->camera = &shadow->view;
+  t->projection = &shadow->projection;
+  transform_update(t);
+  clear_render(render);
+}
+
+/**
+ * @description: Rasterize the shadow map and give the main pass back to the render.
+ */
+void end_shadow_pass(wg_render_t *render, wg_shadow_map_t *shadow) {
+  wg_transform_t *t = &render->transform;
+  flush_render(render);
+  bind_render_target(render, shadow->savedTarget);
+  render->gbufferMode = shadow->savedMode;
+  *t = shadow->savedTransform;
+  *t->transform = shadow->savedMat;
+  *t->transform_p = shadow->savedMatP;
+  update_shadow_map(render, shadow);
+}
+
+/**
+ * @description: Refresh shadow->toLight for the current camera of the render.
+ */
+void update_shadow_map(const wg_render_t *render, wg_shadow_map_t *shadow) {
+  wg_mat44f lightVP, invCamera;
+  Assert(matinv(render->transform.camera, &invCamera), "Camera matrix is singular.");
+  matmul(&shadow->projection, &shadow->view, &lightVP);
+  matmul(&lightVP, &invCamera, &shadow->toLight);
+}
+
+/**
+ * @description: Fraction of the PCF taps around a point that the light of
+ *  render->shadow reaches. Points outside of the shadow map are lit.
+ * @param {vPos} Camera space position, e.g. wg_gbuff_t.vPos.
+ * @return: 0 in full shadow to 1 fully lit.
+ */
+float sample_shadow(const wg_render_t *render, const wg_point_t *vPos) {
+  const wg_shadow_map_t *shadow = render->shadow;
+  const float *depth = shadow->target->depth;
+  wg_vec4f p = { {{vPos->x, vPos->y, vPos->z, 1.f}} }, q;
+  matvecmul4(&shadow->toLight, &p, &q);
+  // Behind the light
+  if (q.w <= 0.f) return 1.f;
+  float rw = 1.f / q.w, size = (float)shadow->size;
+  float z = q.z * rw - shadow->bias;
+  // Texel centers sit on integer coordinates, like pixels of the rasterizer
+  int cx = (int)floorf((q.x * rw * .5f + .5f) * size + .5f);
+  int cy = (int)floorf((.5f - q.y * rw * .5f) * size + .5f);
+  int r = shadow->pcf, lit = 0;
+  for (int y = cy - r; y <= cy + r; y ++) {
+    for (int x = cx - r; x <= cx + r; x ++) {
+      if (x < 0 || y < 0 || x >= (int)shadow->size || y >= (int)shadow->size) {
+        lit ++;
+      } else {
+        lit += z <= depth[y * shadow->size + x];
+      }
+    }
+  }
+  return (float)lit / ((2 * r + 1) * (2 * r + 1));
+}
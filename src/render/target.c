@@ -0,0 +1,185 @@
+#include "render.h"
+#include "raster.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Planes of a target are cache line aligned inside its block, blocks of at
+   least HUGE_PAGE bytes are aligned to huge pages. */
+#define PLANE_ALIGN 64
+#define HUGE_PAGE (2u << 20)
+
+static size_t align_up(size_t n, size_t a) {
+  return (n + a - 1) / a * a;
+}
+
+/**
+ * @description: Point the attachments of a target into its block.
+ * @param {target} Width, height & attachments are set, memory may be NULL.
+ * @return: Bytes of the block.
+ */
+static size_t carve_target(wg_render_target_t *target) {
+  size_t len = (size_t)target->width * target->height, offset = 0;
+  uint8_t *base = (uint8_t*)target->memory;
+#define CARVE(ptr, type, size) do { \
+    ptr = (type*)(base ? base + offset : NULL); \
+    offset = align_up(offset + (size), PLANE_ALIGN); \
+  } while (0)
+  if (target->attachments & ATTACH_COLOR) {
+    CARVE(target->color->buffer, uint8_t, len * 4);
+  }
+  if (target->attachments & ATTACH_DEPTH) {
+    CARVE(target->depth, float, len * sizeof(float));
+    CARVE(target->stencil, uint8_t, len * sizeof(uint8_t));
+  }
+  if (target->attachments & ATTACH_GBUFFER) {
+    CARVE(target->gBuffer.normal, uint32_t, len * sizeof(uint32_t));
+    CARVE(target->gBuffer.tc, uint32_t, len * sizeof(uint32_t));
+    CARVE(target->gBuffer.vColor, uint32_t, len * sizeof(uint32_t));
+    CARVE(target->gBuffer.color, uint32_t, len * sizeof(uint32_t));
+    CARVE(target->gBuffer.footprint, uint8_t, len * sizeof(uint8_t));
+    CARVE(target->gBuffer.materialId, uint8_t, len * sizeof(uint8_t));
+  }
+  if (target->attachments & ATTACH_VISIBILITY) {
+    CARVE(target->gBuffer.primId, uint32_t, len * sizeof(uint32_t));
+  }
+#undef CARVE
+  return offset;
+}
+
+/**
+ * @description: Give a target a block of at least size bytes. The old one is
+ *  kept if it is large enough.
+ */
+static void reserve_target(wg_render_target_t *target, size_t size) {
+  if (size <= target->capacity) return;
+  size_t align = size >= HUGE_PAGE ? HUGE_PAGE : PLANE_ALIGN;
+  free(target->memory);
+  target->capacity = align_up(size, align);
+  Assert(posix_memalign(&target->memory, align, target->capacity) == 0,
+         "Cannot allocate %zu bytes for a render target.", target->capacity);
+#ifdef MADV_HUGEPAGE
+  if (align == HUGE_PAGE) madvise(target->memory, target->capacity, MADV_HUGEPAGE);
+#endif
+}
+
+/**
+ * @description: Create a render target. All attachments are carved from one
+ *  aligned block. The binner & hierarchical z buffer the rasterizer keeps per
+ *  tile come with every target.
+ * @param {width, height} Size in pixels.
+ * @param {attachments} enum TARGET_ATTACHMENT bits, the others stay NULL.
+ * @return: Pointer to the new render target.
+ */
+wg_render_target_t* create_render_target(uint32_t width, uint32_t height, uint32_t attachments) {
+  wg_render_target_t *target = (wg_render_target_t*)malloc(sizeof(wg_render_target_t));
+  target->width = target->height = 0;
+  target->attachments = attachments;
+  target->color = NULL;
+  target->depth = NULL;
+  target->stencil = NULL;
+  target->gBuffer = (wg_gbuffer_t){NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+  target->memory = NULL;
+  target->capacity = 0;
+  target->binner = NULL;
+  target->hiz = NULL;
+  if (attachments & ATTACH_COLOR) {
+    target->color = (wg_texture_t*)malloc(sizeof(wg_texture_t));
+    target->color->layout = LAYOUT_LINEAR;
+    target->color->format = TEX_RGBA8;
+    target->color->targetOwned = 1;
+    target->color->levels = 1;
+  }
+  resize_render_target(target, width, height);
+  return target;
+}
+
+/**
+ * @description: Change the size of a target. Its block is only reallocated
+ *  when it grows past the capacity, the contents are lost either way.
+ * @param {width, height} New size in pixels.
+ */
+void resize_render_target(wg_render_target_t *target, uint32_t width, uint32_t height) {
+  int sameTiles = target->binner != NULL &&
+    (width + TILE_SIZE - 1) / TILE_SIZE == (target->width + TILE_SIZE - 1) / TILE_SIZE &&
+    (height + TILE_SIZE - 1) / TILE_SIZE == (target->height + TILE_SIZE - 1) / TILE_SIZE &&
+    (width + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE == (target->width + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE &&
+    (height + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE == (target->height + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+  target->width = width;
+  target->height = height;
+  reserve_target(target, carve_target(target));
+  carve_target(target);
+  if (target->color != NULL) {
+    wg_texture_t *tex = target->color;
+    for (uint32_t l = 1; l < tex->levels; l ++) free(tex->mip[l]);
+    tex->width = width;
+    tex->height = height;
+    tex->len = (size_t)width * height * 4;
+    tex->levels = 1;
+    tex->mip[0] = tex->buffer;
+  }
+  if (sameTiles) {
+    reset_binner(target->binner);
+    memset(target->binner->coverage, 0, target->binner->tilesX * target->binner->tilesY * TILE_SIZE * sizeof(uint64_t));
+    memset(target->binner->tileState, TILE_STALE, target->binner->tilesX * target->binner->tilesY);
+  } else {
+    if (target->binner != NULL) destroy_binner(target->binner);
+    if (target->hiz != NULL) destroy_hiz(target->hiz);
+    target->binner = create_binner(width, height);
+    target->hiz = create_hiz(width, height);
+  }
+  reset_hiz(target->hiz, CLEAR_DEPTH);
+}
+
+/**
+ * @description: Free a render target and its attachments. It must not be bound.
+ *  The color texture goes with it, with its mip levels if any were generated.
+ *  It must not be passed to delete_texture.
+ */
+void destroy_render_target(wg_render_target_t *target) {
+  if (target->color != NULL) {
+    for (uint32_t l = 1; l < target->color->levels; l ++) free(target->color->mip[l]);
+  }
+  free(target->color);
+  free(target->memory);
+  destroy_binner(target->binner);
+  destroy_hiz(target->hiz);
+  free(target);
+}
+
+/**
+ * @description: Bytes held by a target: its block, binner & hierarchical z buffer.
+ */
+size_t render_target_footprint(const wg_render_target_t *target) {
+  const wg_binner_t *binner = target->binner;
+  const wg_hiz_t *hiz = target->hiz;
+  uint32_t nTiles = binner->tilesX * binner->tilesY, nBlocks = hiz->blocksX * hiz->blocksY;
+  size_t size = sizeof(wg_render_target_t) + target->capacity;
+  if (target->color != NULL) size += sizeof(wg_texture_t);
+  size += sizeof(wg_binner_t) + binner->capTri * sizeof(wg_tri_setup_t);
+  size += nTiles * (sizeof(uint32_t*) + 2 * sizeof(uint32_t) + TILE_SIZE * sizeof(uint64_t) + 1);
+  for (uint32_t i = 0; i < nTiles; i ++) size += binner->binCap[i] * sizeof(uint32_t);
+  size += sizeof(wg_hiz_t) + (nBlocks + nTiles) * 2 * sizeof(float);
+  return size;
+}
+
+/**
+ * @description: Draw, shade & resolve into a render target from now on.
+ *  Only pointers are swapped, nothing is copied or cleared. Triangles binned
+ *  but not flushed yet stay with the target they were drawn into.
+ * @param {target} The target, NULL for the one of set_up_render.
+ */
+void bind_render_target(wg_render_t *render, wg_render_target_t *target) {
+  if (target == NULL) target = render->defaultTarget;
+  render->target = target;
+  render->width = target->width;
+  render->height = target->height;
+  render->frameBuffer = target->color ? target->color->buffer : NULL;
+  render->zBuffer = target->depth;
+  render->stencil = target->stencil;
+  render->gBuffer = target->gBuffer;
+  render->binner = target->binner;
+  render->hiz = target->hiz;
+  render->transform.w = target->width;
+  render->transform.h = target->height;
+}
@@ -2,18 +2,34 @@
 
 #include <stdlib.h>
 
-wg_vertex_t *assemble_vertex(const wg_mesh_t *mesh) {
+static void copy_vertex(const wg_mesh_t *mesh, wg_vertex_t *v) {
   uint32_t nv = mesh->nVertex;
-  wg_vertex_t *v = (wg_vertex_t*)malloc(nv * sizeof(wg_vertex_t));
   for (int i = 0; i < nv; i ++) {
     v[i].vPos = mesh->vertex[i];
     v[i].normal = mesh->normal[i];
     v[i].tc = mesh->tc[i];
     v[i].vColor = mesh->vColor[i];
   }
+}
+
+wg_vertex_t *assemble_vertex(const wg_mesh_t *mesh) {
+  wg_vertex_t *v = (wg_vertex_t*)malloc(mesh->nVertex * sizeof(wg_vertex_t));
+  copy_vertex(mesh, v);
   return v;
 }
 
+/**
+ * @description: Draw a mesh with the current transform of render.
+ *  Vertexes are assembled into render owned storage, nothing is allocated per draw.
+ * @param {wg_render_t *render}
+ * @param {const wg_mesh_t *mesh}
+ */
+void draw_indexed(wg_render_t *render, const wg_mesh_t *mesh) {
+  wg_vertex_t *v = reserve_vertexes(render, mesh->nVertex);
+  copy_vertex(mesh, v);
+  draw_elements(render, v, mesh->nVertex, mesh->triangle, mesh->nTriangle);
+}
+
 void destroy_mesh(wg_mesh_t *mesh) {
   free(mesh->vertex);
   free(mesh->normal);
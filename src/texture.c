@@ -2,6 +2,225 @@
 #include <stdlib.h>
 #include <math.h>
 
+/* Texel levels are cache line aligned, so that every tile of LAYOUT_TILED
+   fills exactly one cache line */
+#define LEVEL_ALIGN 64
+
+/* Gamma decode of an 8 bit channel */
+static float gamma_decode_lut[256];
+
+/* Gamma encode of a linear channel to 8 bits, indexed by the float bits of the
+   value: ENCODE_MANTISSA mantissa bits of every binade in [ENCODE_MIN, 1). The
+   error stays below 1 LSB everywhere, and values below ENCODE_MIN encode to 0. */
+#define ENCODE_MIN_BITS 0x33800000u         // 2^-24
+#define ENCODE_MAX_BITS 0x3f7fffffu         // Largest float below 1
+#define ENCODE_MANTISSA 8
+#define ENCODE_SHIFT (23 - ENCODE_MANTISSA)
+#define ENCODE_SIZE (((ENCODE_MAX_BITS - ENCODE_MIN_BITS) >> ENCODE_SHIFT) + 1)
+static uint8_t gamma_encode_lut[ENCODE_SIZE];
+
+static inline float u32_as_float(uint32_t u) {
+  union { uint32_t u; float f; } v = { u };
+  return v.f;
+}
+
+static inline uint32_t float_as_u32(float f) {
+  union { float f; uint32_t u; } v = { f };
+  return v.u;
+}
+
+__attribute__((constructor))
+static void init_gamma_lut() {
+  for (int i = 0; i < 256; i ++) gamma_decode_lut[i] = powf((float)(i / 255.), GAMMA);
+  for (uint32_t i = 0; i < ENCODE_SIZE; i ++) {
+    // Center of the bucket
+    float f = u32_as_float(ENCODE_MIN_BITS + (i << ENCODE_SHIFT) + (1u << (ENCODE_SHIFT - 1)));
+    gamma_encode_lut[i] = (uint8_t)(powf(f, GAMMA_INV) * 255.f + .5f);
+  }
+}
+
+/**
+ * @description: Linear color of a texel, through the gamma decode table.
+ */
+static inline wg_color_t texel_color(uint32_t c) {
+  return (wg_color_t){gamma_decode_lut[c & 255], gamma_decode_lut[(c >> 8) & 255], gamma_decode_lut[(c >> 16) & 255]};
+}
+
+/**
+ * @description: Gamma encode a linear color into 8 bit channels with r in the
+ *  lowest byte, the inverse of the texture decode. Channels are clamped to [0, 1].
+ */
+#ifdef __SSE2__
+/* Indexes into gamma_encode_lut of 4 channels, clamped to [0, 1] */
+static inline __m128i encode_index(__m128 v) {
+  // max returns its second operand on NaN, so NaN becomes 0
+  v = _mm_max_ps(v, _mm_castsi128_ps(_mm_set1_epi32(ENCODE_MIN_BITS)));
+  v = _mm_min_ps(v, _mm_castsi128_ps(_mm_set1_epi32(ENCODE_MAX_BITS)));
+  return _mm_srli_epi32(_mm_sub_epi32(_mm_castps_si128(v), _mm_set1_epi32(ENCODE_MIN_BITS)), ENCODE_SHIFT);
+}
+#endif
+
+uint32_t gamma_encode_color(const wg_color_t *c) {
+#ifdef __SSE2__
+  uint32_t i[4];
+  _mm_storeu_si128((__m128i*)i, encode_index(_mm_set_ps(0.f, c->b, c->g, c->r)));
+  return (uint32_t)gamma_encode_lut[i[0]] | (uint32_t)gamma_encode_lut[i[1]] << 8 | (uint32_t)gamma_encode_lut[i[2]] << 16;
+#else
+  const float ch[3] = {c->r, c->g, c->b};
+  uint32_t res = 0;
+  for (int k = 0; k < 3; k ++) {
+    float f = ch[k] > u32_as_float(ENCODE_MIN_BITS) ? ch[k] : u32_as_float(ENCODE_MIN_BITS);
+    f = f < u32_as_float(ENCODE_MAX_BITS) ? f : u32_as_float(ENCODE_MAX_BITS);
+    res |= (uint32_t)gamma_encode_lut[(float_as_u32(f) - ENCODE_MIN_BITS) >> ENCODE_SHIFT] << (k * 8);
+  }
+  return res;
+#endif
+}
+
+#ifdef __SSE2__
+/**
+ * @description: gamma_encode_color of 4 colors at once, given by channel.
+ *  Clamping & indexing are vectorized, SSE2 has no gather for the lookups.
+ * @return: The 4 encoded colors, r in the lowest byte.
+ */
+__m128i gamma_encode_ps(__m128 r, __m128 g, __m128 b) {
+  uint32_t ir[4], ig[4], ib[4], res[4];
+  _mm_storeu_si128((__m128i*)ir, encode_index(r));
+  _mm_storeu_si128((__m128i*)ig, encode_index(g));
+  _mm_storeu_si128((__m128i*)ib, encode_index(b));
+  for (int k = 0; k < 4; k ++) {
+    res[k] = (uint32_t)gamma_encode_lut[ir[k]] | (uint32_t)gamma_encode_lut[ig[k]] << 8 | (uint32_t)gamma_encode_lut[ib[k]] << 16;
+  }
+  return _mm_loadu_si128((const __m128i*)res);
+}
+#endif
+
+/**
+ * @description: Allocate the texels of a level, aligned to LEVEL_ALIGN. Freed by free.
+ */
+static void* alloc_level(size_t bytes) {
+  void *p;
+  Assert(posix_memalign(&p, LEVEL_ALIGN, bytes) == 0, "Cannot allocate %zu bytes for a texture level.", bytes);
+  return p;
+}
+
+static inline uint32_t level_width(const wg_texture_t *tex, uint32_t l) {
+  return tex->width >> l ? tex->width >> l : 1;
+}
+
+static inline uint32_t level_height(const wg_texture_t *tex, uint32_t l) {
+  return tex->height >> l ? tex->height >> l : 1;
+}
+
+/* Texels of level l in the given layout, tiled levels are padded to whole tiles */
+static size_t level_size(const wg_texture_t *tex, enum TEX_LAYOUT layout, uint32_t l) {
+  uint32_t w = level_width(tex, l), h = level_height(tex, l);
+  if (layout == LAYOUT_TILED) {
+    w = (w + TEX_TILE - 1) / TEX_TILE * TEX_TILE;
+    h = (h + TEX_TILE - 1) / TEX_TILE * TEX_TILE;
+  }
+  return (size_t)w * h;
+}
+
+/**
+ * @description: Index of texel (x, y) of level l in the given layout. Tiled
+ *  levels store TEX_TILE x TEX_TILE tiles in row major order, each tile is
+ *  row major inside and fills one cache line.
+ */
+static inline size_t texel_index(const wg_texture_t *tex, enum TEX_LAYOUT layout, uint32_t l, uint32_t x, uint32_t y) {
+  if (layout == LAYOUT_TILED) {
+    uint32_t tilesX = (level_width(tex, l) + TEX_TILE - 1) / TEX_TILE;
+    return ((size_t)(y / TEX_TILE) * tilesX + x / TEX_TILE) * (TEX_TILE * TEX_TILE) + (y % TEX_TILE) * TEX_TILE + x % TEX_TILE;
+  }
+  return (size_t)y * level_width(tex, l) + x;
+}
+
+/* Bytes of a block of a compressed format */
+static inline uint32_t block_bytes(enum TEX_FORMAT format) {
+  return format == TEX_BC1 ? 8 : 16;
+}
+
+static inline size_t level_blocks(const wg_texture_t *tex, uint32_t l) {
+  return (size_t)((level_width(tex, l) + TEX_BLOCK - 1) / TEX_BLOCK) * ((level_height(tex, l) + TEX_BLOCK - 1) / TEX_BLOCK);
+}
+
+static inline uint32_t expand_565(uint32_t c) {
+  uint32_t r = c >> 11, g = (c >> 5) & 63, b = c & 31;
+  return (r << 3 | r >> 2) | (g << 2 | g >> 4) << 8 | (b << 3 | b >> 2) << 16;
+}
+
+/* (wa * a + wb * b) / d of every channel, rounded */
+static inline uint32_t mix_channels(uint32_t a, uint32_t b, uint32_t wa, uint32_t wb, uint32_t d) {
+  uint32_t res = 0;
+  for (int k = 0; k < 24; k += 8) {
+    res |= ((wa * ((a >> k) & 255) + wb * ((b >> k) & 255) + d / 2) / d) << k;
+  }
+  return res;
+}
+
+/**
+ * @description: Palette of a BC1 color block. Blocks whose first endpoint is
+ *  not above the second have 3 colors & transparent black, unless fourColor
+ *  as in BC3.
+ * @param {pal} Output, 4 colors with alpha in the top byte.
+ */
+static void bc1_palette(const uint8_t *block, int fourColor, uint32_t pal[4]) {
+  uint32_t e0 = block[0] | block[1] << 8, e1 = block[2] | block[3] << 8;
+  uint32_t c0 = expand_565(e0), c1 = expand_565(e1);
+  pal[0] = c0 | 0xff000000;
+  pal[1] = c1 | 0xff000000;
+  if (e0 > e1 || fourColor) {
+    pal[2] = mix_channels(c0, c1, 2, 1, 3) | 0xff000000;
+    pal[3] = mix_channels(c0, c1, 1, 2, 3) | 0xff000000;
+  } else {
+    pal[2] = mix_channels(c0, c1, 1, 1, 2) | 0xff000000;
+    pal[3] = 0;
+  }
+}
+
+/* Palette of a BC3 alpha block, 8 interpolated values or 6 & 0 & 255 */
+static void bc3_alpha_palette(const uint8_t *block, uint32_t pal[8]) {
+  uint32_t a0 = block[0], a1 = block[1];
+  pal[0] = a0;
+  pal[1] = a1;
+  if (a0 > a1) {
+    for (uint32_t k = 2; k < 8; k ++) pal[k] = ((8 - k) * a0 + (k - 1) * a1 + 3) / 7;
+  } else {
+    for (uint32_t k = 2; k < 6; k ++) pal[k] = ((6 - k) * a0 + (k - 1) * a1 + 2) / 5;
+    pal[6] = 0;
+    pal[7] = 255;
+  }
+}
+
+/**
+ * @description: Decode texel (x, y) of level l of a compressed texture. Only
+ *  the palette entry of the texel is computed.
+ */
+static uint32_t block_pixel(const wg_texture_t *tex, uint32_t l, uint32_t x, uint32_t y) {
+  uint32_t blocksX = (level_width(tex, l) + TEX_BLOCK - 1) / TEX_BLOCK;
+  const uint8_t *block = tex->mip[l] + ((size_t)(y / TEX_BLOCK) * blocksX + x / TEX_BLOCK) * block_bytes(tex->format);
+  uint32_t i = (y % TEX_BLOCK) * TEX_BLOCK + x % TEX_BLOCK, pal[8];
+  if (tex->format == TEX_BC1) {
+    bc1_palette(block, 0, pal);
+    return pal[(block[4 + i / 4] >> (i % 4 * 2)) & 3];
+  }
+  uint64_t bits = 0;
+  for (int k = 0; k < 6; k ++) bits |= (uint64_t)block[2 + k] << (k * 8);
+  bc3_alpha_palette(block, pal);
+  uint32_t alpha = pal[(bits >> (i * 3)) & 7];
+  bc1_palette(block + 8, 1, pal);
+  return (pal[(block[12 + i / 4] >> (i % 4 * 2)) & 3] & 0xffffff) | alpha << 24;
+}
+
+static inline uint32_t level_pixel(const wg_texture_t *tex, uint32_t l, uint32_t x, uint32_t y) {
+  if (tex->format != TEX_RGBA8) return block_pixel(tex, l, x, y);
+  return ((const uint32_t*)tex->mip[l])[texel_index(tex, tex->layout, l, x, y)];
+}
+
+static inline void set_level_pixel(wg_texture_t *tex, uint32_t l, uint32_t x, uint32_t y, uint32_t c) {
+  ((uint32_t*)tex->mip[l])[texel_index(tex, tex->layout, l, x, y)] = c;
+}
+
 /**
  * @description: Returns an empty texture buffer. 
  * @param {width} The width of texture.
@@ -13,10 +232,42 @@ wg_texture_t* get_empty_texture(uint32_t width, uint32_t height) {
   tex->width = width;
   tex->height = height;
   tex->len = (size_t)(width * height * 4);
-  tex->buffer = (uint8_t*)malloc(tex->len);
+  tex->buffer = (uint8_t*)alloc_level(tex->len);
+  tex->layout = LAYOUT_LINEAR;
+  tex->format = TEX_RGBA8;
+  tex->targetOwned = 0;
+  tex->levels = 1;
+  tex->mip[0] = tex->buffer;
   return tex;
 }
 
+/**
+ * @description: Convert every level of a texture into another layout. Meant
+ *  to be done once, after the texels are uploaded. Textures of render targets
+ *  must stay linear.
+ * @param {wg_texture_t *tex} Texture.
+ * @param {layout} The new layout.
+ */
+void set_texture_layout(wg_texture_t *tex, enum TEX_LAYOUT layout) {
+  if (tex->layout == layout) return;
+  Assert(!tex->targetOwned, "Textures of render targets must stay linear.");
+  Assert(tex->format == TEX_RGBA8, "Compressed textures keep their block order.");
+  for (uint32_t l = 0; l < tex->levels; l ++) {
+    uint32_t *dst = (uint32_t*)alloc_level(level_size(tex, layout, l) * sizeof(uint32_t));
+    const uint32_t *src = (const uint32_t*)tex->mip[l];
+    for (uint32_t y = 0; y < level_height(tex, l); y ++) {
+      for (uint32_t x = 0; x < level_width(tex, l); x ++) {
+        dst[texel_index(tex, layout, l, x, y)] = src[texel_index(tex, tex->layout, l, x, y)];
+      }
+    }
+    free(tex->mip[l]);
+    tex->mip[l] = (uint8_t*)dst;
+  }
+  tex->layout = layout;
+  tex->buffer = tex->mip[0];
+  tex->len = level_size(tex, layout, 0) * sizeof(uint32_t);
+}
+
 /**
  * @description: Deletes a texture buffer. 
  * @param {ptex} A pointer to the texture pointer. 
@@ -24,8 +275,11 @@ wg_texture_t* get_empty_texture(uint32_t width, uint32_t height) {
  */
 void delete_texture(wg_texture_t **ptex) {
   wg_texture_t *tex = *ptex;
+  Assert(!tex->targetOwned, "Textures of render targets go with destroy_render_target.");
+  for (uint32_t l = 1; l < tex->levels; l ++) free(tex->mip[l]);
   free(tex->buffer);
-  free(ptex);
+  free(tex);
+  *ptex = NULL;
 }
 /**
  * @description: Get pixel color of texture buffer.
@@ -35,8 +289,7 @@ void delete_texture(wg_texture_t **ptex) {
  */
 uint32_t get_pixel(const wg_texture_t *tex, uint32_t x, uint32_t y) {
   Assert(x >= 0 && x < tex->width && y >= 0 && y < tex->height, "Coord must be in bounds of texture. (%u, %u)", x, y);
-  uint32_t *buf = (uint32_t*)tex->buffer;
-  return buf[x + y * tex->width];
+  return level_pixel(tex, 0, x, y);
 }
 
 /**
@@ -47,13 +300,13 @@ uint32_t get_pixel(const wg_texture_t *tex, uint32_t x, uint32_t y) {
  * @return: 
  */
 void set_chessboard_texture(wg_texture_t *tex, int u, int v, uint32_t c1, uint32_t c2) {
-  uint32_t *buf = (uint32_t*)tex->buffer;
+  Assert(tex->format == TEX_RGBA8, "Compressed textures are read only.");
   for (int y = 0; y < tex->height; y ++) {
     for (int x = 0; x < tex->width; x ++) {
       if ((y / v + x / u) & 1) {
-        buf[y * tex->width + x] = c1;
+        set_level_pixel(tex, 0, x, y, c1);
       } else {
-        buf[y * tex->width + x] = c2;
+        set_level_pixel(tex, 0, x, y, c2);
       }
     }
   }
@@ -71,64 +324,278 @@ void set_chessboard_texture(wg_texture_t *tex, int u, int v, uint32_t c1, uint32
   c0.b += c1.b * (m);  \
 } while(0)
 
+/**
+ * @description: Build the mip chain of a texture down to 1x1. Every texel is
+ *  the average of the 2x2 texels above it, in linear space. Call it again
+ *  after changing level 0.
+ * @param {wg_texture_t *tex} Texture.
+ */
+void generate_mipmaps(wg_texture_t *tex) {
+  Assert(tex->format == TEX_RGBA8, "Generate mipmaps before compress_texture.");
+  for (uint32_t l = 1; l < tex->levels; l ++) free(tex->mip[l]);
+  tex->mip[0] = tex->buffer;
+  tex->levels = 1;
+  while (tex->levels < MAX_MIP_LEVELS && (level_width(tex, tex->levels - 1) > 1 || level_height(tex, tex->levels - 1) > 1)) {
+    uint32_t src = tex->levels - 1, l = tex->levels;
+    uint32_t sw = level_width(tex, src), sh = level_height(tex, src);
+    uint32_t w = level_width(tex, l), h = level_height(tex, l);
+    tex->mip[l] = (uint8_t*)alloc_level(level_size(tex, tex->layout, l) * sizeof(uint32_t));
+    for (uint32_t y = 0; y < h; y ++) {
+      for (uint32_t x = 0; x < w; x ++) {
+        wg_color_t sum = (wg_color_t){0., 0., 0.};
+        for (uint32_t k = 0; k < 4; k ++) {
+          uint32_t sx = 2 * x + (k & 1), sy = 2 * y + (k >> 1);
+          wg_color_t c = texel_color(level_pixel(tex, src, sx < sw ? sx : sw - 1, sy < sh ? sy : sh - 1));
+          C_MUL_ADD(sum, c, .25f);
+        }
+        sum = gamma_trans(&sum, 1.f / GAMMA);
+        set_level_pixel(tex, l, x, y, (uint32_t)(sum.r * 255.f + .5f) | (uint32_t)(sum.g * 255.f + .5f) << 8 | (uint32_t)(sum.b * 255.f + .5f) << 16);
+      }
+    }
+    tex->levels ++;
+  }
+}
+
+/* Squared distance of two colors */
+static inline int color_dist(uint32_t a, uint32_t b) {
+  int d = 0;
+  for (int k = 0; k < 24; k += 8) {
+    int c = (int)((a >> k) & 255) - (int)((b >> k) & 255);
+    d += c * c;
+  }
+  return d;
+}
+
+/* Red in the top bits, like the texels of expand_565 */
+static inline uint32_t quantize_565(const float c[3]) {
+  return (uint32_t)(c[0] * 31.f / 255.f + .5f) << 11 | (uint32_t)(c[1] * 63.f / 255.f + .5f) << 5 | (uint32_t)(c[2] * 31.f / 255.f + .5f);
+}
+
+/**
+ * @description: Encode the colors of a 4x4 block as BC1, in 4 color mode. The
+ *  endpoints are the extremes of the texels along their principal axis.
+ * @param {texels} 16 texels in row major order.
+ * @param {block} Output, 8 bytes.
+ */
+static void encode_bc1_block(const uint32_t texels[16], uint8_t *block) {
+  float c[16][3], mean[3] = {0.f, 0.f, 0.f}, cov[6] = {0.f};
+  for (int i = 0; i < 16; i ++) {
+    for (int k = 0; k < 3; k ++) {
+      c[i][k] = (float)((texels[i] >> (k * 8)) & 255);
+      mean[k] += c[i][k] / 16.f;
+    }
+  }
+  for (int i = 0; i < 16; i ++) {
+    float r = c[i][0] - mean[0], g = c[i][1] - mean[1], b = c[i][2] - mean[2];
+    cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+    cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+  }
+  // Power iteration from the diagonal, the channel that varies the most dominates
+  float axis[3] = {cov[0], cov[3], cov[5]};
+  for (int it = 0; it < 4; it ++) {
+    float a[3] = {
+      cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2],
+      cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+      cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2]
+    };
+    float n = fmaxf(fabsf(a[0]), fmaxf(fabsf(a[1]), fabsf(a[2])));
+    if (n == 0.f) break;
+    for (int k = 0; k < 3; k ++) axis[k] = a[k] / n;
+  }
+  int lo = 0, hi = 0;
+  float dlo = INFINITY, dhi = -INFINITY;
+  for (int i = 0; i < 16; i ++) {
+    float d = c[i][0] * axis[0] + c[i][1] * axis[1] + c[i][2] * axis[2];
+    if (d < dlo) { dlo = d; lo = i; }
+    if (d > dhi) { dhi = d; hi = i; }
+  }
+  uint32_t e0 = quantize_565(c[hi]), e1 = quantize_565(c[lo]);
+  if (e0 < e1) {
+    uint32_t t = e0; e0 = e1; e1 = t;
+  }
+  block[0] = e0 & 255; block[1] = e0 >> 8;
+  block[2] = e1 & 255; block[3] = e1 >> 8;
+  uint32_t pal[4];
+  bc1_palette(block, 1, pal);
+  for (int i = 0; i < 16; i ++) {
+    int best = 0;
+    for (int j = 1; j < 4; j ++) {
+      if (color_dist(pal[j], texels[i]) < color_dist(pal[best], texels[i])) best = j;
+    }
+    if (i % 4 == 0) block[4 + i / 4] = 0;
+    block[4 + i / 4] |= best << (i % 4 * 2);
+  }
+}
+
+/**
+ * @description: Encode the alpha of a 4x4 block as BC3, between its extremes.
+ * @param {texels} 16 texels in row major order.
+ * @param {block} Output, 8 bytes.
+ */
+static void encode_bc3_alpha(const uint32_t texels[16], uint8_t *block) {
+  uint32_t lo = 255, hi = 0, pal[8];
+  for (int i = 0; i < 16; i ++) {
+    uint32_t a = texels[i] >> 24;
+    lo = a < lo ? a : lo;
+    hi = a > hi ? a : hi;
+  }
+  block[0] = hi;
+  block[1] = lo;
+  bc3_alpha_palette(block, pal);
+  uint64_t bits = 0;
+  for (int i = 0; i < 16; i ++) {
+    int a = texels[i] >> 24, best = 0;
+    for (int j = 1; j < 8; j ++) {
+      if (abs((int)pal[j] - a) < abs((int)pal[best] - a)) best = j;
+    }
+    bits |= (uint64_t)best << (i * 3);
+  }
+  for (int k = 0; k < 6; k ++) block[2 + k] = (bits >> (k * 8)) & 255;
+}
+
+/**
+ * @description: Compress every level of a texture into 4x4 blocks, 8 (BC1)
+ *  or 4 (BC3) times smaller than TEX_RGBA8. The texture becomes read only,
+ *  the samplers & get_pixel decode the texels they touch.
+ * @param {wg_texture_t *tex} An uncompressed texture, with its mipmaps if any.
+ * @param {format} TEX_BC1, which drops alpha, or TEX_BC3.
+ */
+void compress_texture(wg_texture_t *tex, enum TEX_FORMAT format) {
+  Assert(tex->format == TEX_RGBA8, "Texture is compressed already.");
+  if (format == TEX_RGBA8) return;
+  Assert(!tex->targetOwned, "Textures of render targets cannot be compressed.");
+  for (uint32_t l = 0; l < tex->levels; l ++) {
+    uint32_t w = level_width(tex, l), h = level_height(tex, l), texels[16];
+    uint8_t *dst = (uint8_t*)alloc_level(level_blocks(tex, l) * block_bytes(format)), *block = dst;
+    for (uint32_t by = 0; by < h; by += TEX_BLOCK) {
+      for (uint32_t bx = 0; bx < w; bx += TEX_BLOCK) {
+        // Partial blocks repeat the last row & column
+        for (uint32_t i = 0; i < 16; i ++) {
+          uint32_t x = bx + i % TEX_BLOCK, y = by + i / TEX_BLOCK;
+          texels[i] = level_pixel(tex, l, x < w ? x : w - 1, y < h ? y : h - 1);
+        }
+        if (format == TEX_BC3) {
+          encode_bc3_alpha(texels, block);
+          encode_bc1_block(texels, block + 8);
+        } else {
+          encode_bc1_block(texels, block);
+        }
+        block += block_bytes(format);
+      }
+    }
+    free(tex->mip[l]);
+    tex->mip[l] = dst;
+  }
+  tex->format = format;
+  tex->buffer = tex->mip[0];
+  tex->len = level_blocks(tex, 0) * block_bytes(format);
+}
+
+/**
+ * @description: Mip level to sample a texture at.
+ * @param {footprint} log2 of the pixel size in uv units, from the rasterizer.
+ * @return: Level in [0, levels - 1], fractional between levels.
+ */
+float texture_lod(const wg_texture_t *tex, float footprint) {
+  float lod = footprint + log2f((float)(tex->width > tex->height ? tex->width : tex->height));
+  lod = CLIP(lod, 0.f, (float)(tex->levels - 1));
+  return lod;
+}
+
 /**
  * @description: Nearest texture sampler
  * @param {const wg_texture_t *tex} Texture
  * @param {flaot x, y} Position
+ * @param {footprint} Ignored, level 0 is sampled.
  * @return: 
  */
-wg_color_t sampler_nearest(const wg_texture_t *tex, float x, float y) {
+wg_color_t sampler_nearest(const wg_texture_t *tex, float x, float y, float footprint) {
   x = CLIP(x, 0.f, 1.f);
   y = CLIP(y, 0.f, 1.f);
   uint32_t ux = floorf(x * tex->width);
   uint32_t uy = floorf(y * tex->height);
   ux = ux < tex->width ? ux : tex->width - 1;
   uy = uy < tex->height ? uy : tex->height - 1;
-  uint32_t c = get_pixel(tex, ux, uy);
-  wg_color_t res = color_cvt_uint2float(c);
-  res = gamma_trans(&res, GAMMA);
-  return res;
+  return texel_color(get_pixel(tex, ux, uy));
 }
 
-/**
- * @description: Bilinear texture sampler
- * @param {const wg_texture_t *tex} Texture
- * @param {flaot x, y} Position
- * @return: 
- */
-wg_color_t sampler_bilinear(const wg_texture_t *tex, float x, float y) {
-  x = CLIP(x, 0.f, 1.f) * (tex->width - 1);
-  y = CLIP(y, 0.f, 1.f) * (tex->height - 1);
+/* Bilinear filter of level l, in linear space */
+static wg_color_t bilinear_level(const wg_texture_t *tex, uint32_t l, float x, float y) {
+  uint32_t w = level_width(tex, l), h = level_height(tex, l);
+  x = CLIP(x, 0.f, 1.f) * (w - 1);
+  y = CLIP(y, 0.f, 1.f) * (h - 1);
   uint32_t x0 = floorf(x);
   uint32_t y0 = floorf(y);
-  x0 = CLIP(x0, 0, tex->width - 2);
-  y0 = CLIP(y0, 0, tex->height - 2);
+  // 1 texel wide levels have a single column, its weight is 1
+  uint32_t dx = w > 1, dy = h > 1;
+  x0 = w > 1 ? CLIP(x0, 0, w - 2) : 0;
+  y0 = h > 1 ? CLIP(y0, 0, h - 2) : 0;
   float u = x0 + 1. - x;
   float v = y0 + 1. - y;
   u = CLIP(u, 0., 1.);
   v = CLIP(v, 0., 1.);
   wg_color_t res = (wg_color_t){0., 0., 0.};
   wg_color_t c;
-  c = color_cvt_uint2float(get_pixel(tex, x0, y0));
+  c = texel_color(level_pixel(tex, l, x0, y0));
   C_MUL_ADD(res, c, u * v);
-  c = color_cvt_uint2float(get_pixel(tex, x0 + 1, y0));
+  c = texel_color(level_pixel(tex, l, x0 + dx, y0));
   C_MUL_ADD(res, c, (1. - u) * v);
-  c = color_cvt_uint2float(get_pixel(tex, x0, y0 + 1));
+  c = texel_color(level_pixel(tex, l, x0, y0 + dy));
   C_MUL_ADD(res, c, u * (1. - v));
-  c = color_cvt_uint2float(get_pixel(tex, x0 + 1, y0 + 1));
+  c = texel_color(level_pixel(tex, l, x0 + dx, y0 + dy));
   C_MUL_ADD(res, c, (1. - u) * (1. - v));
-  res = gamma_trans(&res, GAMMA);
+  return res;
+}
+
+/**
+ * @description: Bilinear texture sampler
+ * @param {const wg_texture_t *tex} Texture
+ * @param {flaot x, y} Position
+ * @param {footprint} Ignored, level 0 is sampled.
+ * @return: 
+ */
+wg_color_t sampler_bilinear(const wg_texture_t *tex, float x, float y, float footprint) {
+  return bilinear_level(tex, 0, x, y);
+}
+
+/**
+ * @description: Bilinear sampler in the mip level nearest to texture_lod.
+ */
+wg_color_t sampler_nearest_mip(const wg_texture_t *tex, float x, float y, float footprint) {
+  uint32_t l = (uint32_t)(texture_lod(tex, footprint) + .5f);
+  return bilinear_level(tex, l, x, y);
+}
+
+/**
+ * @description: Trilinear sampler, blends the bilinear samples of the two mip
+ *  levels around texture_lod.
+ */
+wg_color_t sampler_trilinear(const wg_texture_t *tex, float x, float y, float footprint) {
+  float lod = texture_lod(tex, footprint);
+  uint32_t l = (uint32_t)lod;
+  float t = lod - l;
+  wg_color_t res = bilinear_level(tex, l, x, y);
+  if (t > 0.f) {
+    wg_color_t c = bilinear_level(tex, l + 1, x, y);
+    res.r += (c.r - res.r) * t;
+    res.g += (c.g - res.g) * t;
+    res.b += (c.b - res.b) * t;
+  }
   return res;
 }
 
 #undef CLIP
 #undef C_MUL_ADD
 
-wg_color_t (*load_sampler(enum TEX_SAMPLE_MODE mode))(const wg_texture_t *tex, float x, float y) {
+wg_sampler_t* load_sampler(enum TEX_SAMPLE_MODE mode) {
   if (mode == NEAREST) {
     return &sampler_nearest;
   } else if (mode == BILINEAR) {
     return &sampler_bilinear;
+  } else if (mode == NEAREST_MIP) {
+    return &sampler_nearest_mip;
+  } else if (mode == TRILINEAR) {
+    return &sampler_trilinear;
   } else {
     TODO();
   }